@@ -1,5 +1,20 @@
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MPC_INPUT_MMAP
+#endif
+
 #include "mpc.h"
 
+#include <time.h>
+
+#ifdef MPC_INPUT_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -22,6 +37,23 @@ static mpc_state_t mpc_state_new(void) {
   return s;
 }
 
+/*
+** Hashing
+*/
+
+/*
+** FNV-1a, continued from `h` so a hash can be built
+** up from several pieces. Start from 2166136261. An
+** unsigned long may be wider than 32 bits, so mask
+** the result where the exact 32 bit value matters.
+*/
+
+static unsigned long mpc_fnv1a(const char *s, size_t n, unsigned long h) {
+  size_t j;
+  for (j = 0; j < n; j++) { h = (h ^ (unsigned char)s[j]) * 16777619UL; }
+  return h;
+}
+
 /*
 ** Input Type
 */
@@ -40,6 +72,11 @@ static mpc_state_t mpc_state_new(void) {
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
 **
+** Where possible regular files are instead
+** mapped into memory and treated just like a
+** String, avoiding a round trip through stdio
+** for every character read or peeked.
+**
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and
 ** only support a single character lookahead at
@@ -49,7 +86,19 @@ static mpc_state_t mpc_state_new(void) {
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. Anything left in
+** the buffer once all marks are gone is read
+** from there before going back to the input.
+**
+** While there is a buffer every character read
+** goes into it, even those only peeked at, so
+** stdio never holds any pushback of ours. When
+** the parse is over the first unread character
+** of the buffer is handed back, which is all
+** the pushback stdio promises, and the rest is
+** lost. So a parse which backtracked over input
+** from a pipe may leave the pipe further along
+** than the end of what it matched.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -68,16 +117,137 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_BUFFER_MIN = 64
 };
 
-typedef struct {
-  char mem[64];
+/*
+** Small allocations made while parsing come from
+** a pool of fixed size slots in four size classes
+** of 16, 32, 64 and 128 bytes. Each class keeps a
+** free list, and new slots are carved first from
+** a small store inside the input and then from
+** chunks that double in size as they are added,
+** so large parses stay in the pool.
+*/
+
+enum {
+  MPC_INPUT_MEM_CLASSES = 4,
+  MPC_INPUT_MEM_MIN     = 16,
+  MPC_INPUT_MEM_MAX     = 128,
+  MPC_INPUT_MEM_INLINE  = 64
+};
+
+typedef union {
+  char mem[16];
+  void *ptr;
+  double num;
+  long lnum;
 } mpc_mem_t;
 
+typedef struct mpc_mem_free_t {
+  struct mpc_mem_free_t *next;
+} mpc_mem_free_t;
+
+typedef struct {
+  char *start;
+  char *end;
+  int cls;
+} mpc_mem_chunk_t;
+
+typedef struct {
+  long parses;
+  long allocs;
+  long pooled;
+  long fallbacks;
+  long chunks;
+  long chunk_bytes;
+  long in_use;
+  long peak;
+  long memo_lookups;
+  long memo_hits;
+  long memo_stores;
+  long memo_evictions;
+  long match_runs;
+  long match_fallbacks;
+  long rewinds;
+  long calls;
+  long successes;
+  long backtracks;
+  long consumed;
+  clock_t ticks;
+  int active;
+} mpc_stats_t;
+
+/*
+** Packrat Memo
+**
+** A direct mapped table of results keyed on the
+** parser and the position it was run from. Each
+** entry records where the parser finished, then
+** either the error it failed with or an output
+** salvaged from a sequence that failed after it.
+*/
+
+#ifndef MPC_PARSE_MEMO_SLOTS
+#define MPC_PARSE_MEMO_SLOTS 1024
+#endif
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int suppress;
+  int success;
+  mpc_state_t end;
+  char last;
+  mpc_val_t *output;
+  mpc_dtor_t dtor;
+  mpc_err_t *error;
+} mpc_memo_t;
+
+/*
+** Lazy Errors
+**
+** With `MPC_PARSE_LAZY_ERRORS` no error is built
+** while parsing. Only the farthest position any
+** expectation failed at is kept, along with the
+** messages of those which failed there, compared
+** by address, and an error is made out of them
+** once the whole parse has failed.
+*/
+
+typedef struct {
+  mpc_state_t state;
+  char received;
+  int num;
+  int slots;
+  const char **expected;
+} mpc_far_t;
+
+/*
+** Profiling
+**
+** With `MPC_PARSE_PROFILE` every named parser
+** adds up on its stats how often it was run, how
+** often it matched, how far it got when it did,
+** how many times the input was rewound while it
+** ran and the time it took. Each run in progress
+** keeps where it started on a stack in the input.
+** All but the counts are only added by the
+** outermost run of a rule, so recursion doesn't
+** count them twice.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  long rewinds;
+  clock_t start;
+} mpc_prof_t;
+
 typedef struct {
 
   int type;
+  int mode;
   char *filename;
   mpc_state_t state;
 
@@ -85,7 +255,19 @@ typedef struct {
   char *buffer;
   FILE *file;
 
+  long buffer_start;
+  size_t buffer_len;
+  size_t buffer_slots;
+
+  char *mapped;
+  size_t mapped_length;
+  long file_offset;
+
+  int feeding;
+  long feed_len;
+
   int suppress;
+  int spans;
   int backtrack;
   int marks_slots;
   int marks_num;
@@ -94,12 +276,57 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_ast_arena_t *arena;
+  mpc_memo_t *memo;
+  int memo_values;
+  mpc_far_t far;
+  int prof_num;
+  int prof_slots;
+  mpc_prof_t *prof;
+
+  mpc_stats_t stats;
+  mpc_mem_free_t *mem_free[MPC_INPUT_MEM_CLASSES];
+  char *mem_next[MPC_INPUT_MEM_CLASSES];
+  char *mem_end[MPC_INPUT_MEM_CLASSES];
+  size_t mem_grow[MPC_INPUT_MEM_CLASSES];
+  int mem_chunks_num;
+  int mem_chunks_slots;
+  mpc_mem_chunk_t *mem_chunks;
+  mpc_mem_t mem[MPC_INPUT_MEM_INLINE * ((1 << MPC_INPUT_MEM_CLASSES) - 1)];
 
 } mpc_input_t;
 
+static void mpc_input_mem_init(mpc_input_t *i) {
+
+  int k;
+  char *base = (char*)i->mem;
+
+  /* The inline store holds the same number of slots for every class */
+  for (k = 0; k < MPC_INPUT_MEM_CLASSES; k++) {
+    i->mem_free[k] = NULL;
+    i->mem_next[k] = base;
+    i->mem_end[k] = base + MPC_INPUT_MEM_INLINE * (MPC_INPUT_MEM_MIN << k);
+    i->mem_grow[k] = MPC_INPUT_MEM_INLINE * 2;
+    base = i->mem_end[k];
+  }
+
+  i->mem_chunks_num = 0;
+  i->mem_chunks_slots = 0;
+  i->mem_chunks = NULL;
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
+}
+
+static void mpc_input_mem_delete(mpc_input_t *i) {
+  int k;
+  for (k = 0; k < i->mem_chunks_num; k++) { free(i->mem_chunks[k].start); }
+  free(i->mem_chunks);
+}
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void);
+static void mpc_ast_arena_delete(mpc_ast_arena_t *a);
+static mpc_ast_t *mpc_ast_arena_own(mpc_ast_arena_t *a, mpc_ast_t *root);
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *a, const char *tag, const char *contents, size_t length);
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -114,8 +341,12 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = NULL;
 
   i->suppress = 0;
+  i->spans = 0;
+  i->feeding = 0;
+  i->feed_len = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -123,8 +354,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mode = MPC_PARSE_DEFAULT;
+  i->arena = NULL;
+  i->memo = NULL;
+  i->memo_values = 0;
+  i->prof_num = 0;
+  i->prof_slots = 0;
+  i->prof = NULL;
+  mpc_input_mem_init(i);
 
   return i;
 }
@@ -144,8 +381,12 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = NULL;
 
   i->suppress = 0;
+  i->spans = 0;
+  i->feeding = 0;
+  i->feed_len = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -153,8 +394,14 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mode = MPC_PARSE_DEFAULT;
+  i->arena = NULL;
+  i->memo = NULL;
+  i->memo_values = 0;
+  i->prof_num = 0;
+  i->prof_slots = 0;
+  i->prof = NULL;
+  mpc_input_mem_init(i);
 
   return i;
 
@@ -173,8 +420,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = pipe;
+  i->mapped = NULL;
 
   i->suppress = 0;
+  i->spans = 0;
+  i->feeding = 0;
+  i->feed_len = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -182,13 +433,84 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mode = MPC_PARSE_DEFAULT;
+  i->arena = NULL;
+  i->memo = NULL;
+  i->memo_values = 0;
+  i->prof_num = 0;
+  i->prof_slots = 0;
+  i->prof = NULL;
+  mpc_input_mem_init(i);
 
   return i;
 
 }
 
+/*
+** A regular file is mapped read only from its
+** start, with parsing beginning at the current
+** position of the stream. The zero filled tail
+** of the final page provides the terminator a
+** String expects, so files which exactly fill
+** their last page are read into memory instead.
+**
+** A String ends at its first zero byte, which
+** a File does not, so a file containing one is
+** left to be read as a File.
+*/
+
+static int mpc_input_map_file(mpc_input_t *i, FILE *file) {
+
+#ifdef MPC_INPUT_MMAP
+
+  struct stat st;
+  long offset, page;
+  size_t length, n;
+  char *map;
+  int fd = fileno(file);
+
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+
+  offset = ftell(file);
+  if (offset < 0 || offset > st.st_size) { return 0; }
+
+  length = (size_t)st.st_size;
+  page = sysconf(_SC_PAGESIZE);
+
+  if (length == 0 || page <= 0 || length % (size_t)page == 0) {
+    i->string = malloc(length - offset + 1);
+    n = fread(i->string, 1, length - offset, file);
+    i->string[n] = '\0';
+    if (memchr(i->string, '\0', n)) {
+      free(i->string);
+      fseek(file, offset, SEEK_SET);
+      return 0;
+    }
+    i->mapped = NULL;
+  } else {
+    map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) { return 0; }
+    if (memchr(map + offset, '\0', length - offset)) {
+      munmap(map, length);
+      return 0;
+    }
+    i->string = map + offset;
+    i->mapped = map;
+    i->mapped_length = length;
+  }
+
+  i->type = MPC_INPUT_STRING;
+  i->file = file;
+  i->file_offset = offset;
+  return 1;
+
+#else
+  (void)i; (void)file;
+  return 0;
+#endif
+
+}
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -201,8 +523,18 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->mapped = NULL;
+
+  if (!mpc_input_map_file(i, file)) {
+    i->type = MPC_INPUT_FILE;
+    i->string = NULL;
+    i->file = file;
+  }
 
   i->suppress = 0;
+  i->spans = 0;
+  i->feeding = 0;
+  i->feed_len = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -210,8 +542,14 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mode = MPC_PARSE_DEFAULT;
+  i->arena = NULL;
+  i->memo = NULL;
+  i->memo_values = 0;
+  i->prof_num = 0;
+  i->prof_slots = 0;
+  i->prof = NULL;
+  mpc_input_mem_init(i);
 
   return i;
 }
@@ -220,38 +558,126 @@ static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
+#ifdef MPC_INPUT_MMAP
+  /* Leave the stream just after the input consumed as a File would */
+  if (i->type == MPC_INPUT_STRING && i->file) {
+    fseek(i->file, i->file_offset + i->state.pos, SEEK_SET);
+  }
+  if (i->mapped) {
+    munmap(i->mapped, i->mapped_length);
+    i->string = NULL;
+  }
+#endif
+
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  /* Hand the next unconsumed character back, the rest of any read ahead is lost */
+  if (i->type == MPC_INPUT_PIPE && i->buffer) {
+    if (i->state.pos < i->buffer_start + (long)i->buffer_len) {
+      ungetc(i->buffer[i->state.pos - i->buffer_start], i->file);
+    }
+    free(i->buffer);
+  }
 
+  mpc_ast_arena_delete(i->arena);
+  mpc_input_mem_delete(i);
   free(i->marks);
   free(i->lasts);
+  free(i->prof);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+static int mpc_mem_class_of_size(size_t n) {
+  int k = 0;
+  size_t size = MPC_INPUT_MEM_MIN;
+  while (size < n) { size = size * 2; k++; }
+  return k;
+}
+
+/* The size class a pointer was allocated from or -1 if it came from malloc */
+static int mpc_mem_class(mpc_input_t *i, void *p) {
+
+  char *c = p;
+  int lo, hi, mid;
+  size_t q;
+
+  if (c >= (char*)i->mem && c < (char*)i->mem + sizeof(i->mem)) {
+    q = (size_t)(c - (char*)i->mem) / (MPC_INPUT_MEM_INLINE * MPC_INPUT_MEM_MIN);
+    return q < 1 ? 0 : q < 3 ? 1 : q < 7 ? 2 : 3;
+  }
+
+  lo = 0;
+  hi = i->mem_chunks_num - 1;
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (c < i->mem_chunks[mid].start) { hi = mid - 1; continue; }
+    if (c >= i->mem_chunks[mid].end) { lo = mid + 1; continue; }
+    return i->mem_chunks[mid].cls;
+  }
+
+  return -1;
+}
+
+static int mpc_mem_grow(mpc_input_t *i, int k) {
+
+  int j;
+  size_t size = i->mem_grow[k] * (MPC_INPUT_MEM_MIN << k);
+  char *chunk = malloc(size);
+
+  if (chunk == NULL) { return 0; }
+
+  if (i->mem_chunks_num == i->mem_chunks_slots) {
+    i->mem_chunks_slots = i->mem_chunks_slots ? i->mem_chunks_slots * 2 : 8;
+    i->mem_chunks = realloc(i->mem_chunks, sizeof(mpc_mem_chunk_t) * i->mem_chunks_slots);
+  }
+
+  /* Chunks are kept sorted by address so ownership is a binary search */
+  for (j = i->mem_chunks_num; j > 0 && i->mem_chunks[j-1].start > chunk; j--) {
+    i->mem_chunks[j] = i->mem_chunks[j-1];
+  }
+  i->mem_chunks[j].start = chunk;
+  i->mem_chunks[j].end = chunk + size;
+  i->mem_chunks[j].cls = k;
+  i->mem_chunks_num++;
+
+  i->mem_next[k] = chunk;
+  i->mem_end[k] = chunk + size;
+  i->mem_grow[k] = i->mem_grow[k] * 2;
+
+  i->stats.chunks++;
+  i->stats.chunk_bytes += (long)size;
+  return 1;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+
+  int k;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  i->stats.allocs++;
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
+  if (n > MPC_INPUT_MEM_MAX) {
+    i->stats.fallbacks++;
+    return malloc(n);
+  }
+
+  k = mpc_mem_class_of_size(n);
+
+  if (i->mem_free[k]) {
+    p = (char*)i->mem_free[k];
+    i->mem_free[k] = i->mem_free[k]->next;
+  } else {
+    if (i->mem_next[k] == i->mem_end[k] && !mpc_mem_grow(i, k)) {
+      i->stats.fallbacks++;
+      return malloc(n);
     }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+    p = i->mem_next[k];
+    i->mem_next[k] += MPC_INPUT_MEM_MIN << k;
+  }
 
-  return malloc(n);
+  i->stats.pooled++;
+  i->stats.in_use += MPC_INPUT_MEM_MIN << k;
+  if (i->stats.in_use > i->stats.peak) { i->stats.peak = i->stats.in_use; }
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,21 +687,25 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_mem_free_t *f;
+  int k = mpc_mem_class(i, p);
+  if (k < 0) { free(p); return; }
+  f = p;
+  f->next = i->mem_free[k];
+  i->mem_free[k] = f;
+  i->stats.in_use -= MPC_INPUT_MEM_MIN << k;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  int k = mpc_mem_class(i, p);
 
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (k < 0) { return realloc(p, n); }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
+  if (n > (size_t)(MPC_INPUT_MEM_MIN << k)) {
+    q = mpc_malloc(i, n);
+    memcpy(q, p, MPC_INPUT_MEM_MIN << k);
     mpc_free(i, p);
     return q;
   }
@@ -285,9 +715,10 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  int k = mpc_mem_class(i, p);
+  if (k < 0) { return p; }
+  q = malloc(MPC_INPUT_MEM_MIN << k);
+  memcpy(q, p, MPC_INPUT_MEM_MIN << k);
   mpc_free(i, p);
   return q;
 }
@@ -298,6 +729,38 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+/*
+** The pipe buffer holds the input from position
+** `buffer_start` onward. It is created by the
+** first mark and only grows while marked, so
+** anything before the current position can be
+** dropped again whenever the marks are cleared.
+*/
+
+static void mpc_input_buffer_drop(mpc_input_t *i) {
+
+  size_t used = (size_t)(i->state.pos - i->buffer_start);
+
+  if (used >= i->buffer_len) {
+    free(i->buffer);
+    i->buffer = NULL;
+    i->buffer_len = 0;
+    return;
+  }
+
+  memmove(i->buffer, i->buffer + used, i->buffer_len - used);
+  i->buffer_len -= used;
+  i->buffer_start = i->state.pos;
+}
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  if (i->buffer_len == i->buffer_slots) {
+    i->buffer_slots = i->buffer_slots * 2;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
+  i->buffer[i->buffer_len++] = c;
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
@@ -314,13 +777,20 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->lasts[i->marks_num-1] = i->last;
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    if (i->buffer) {
+      mpc_input_buffer_drop(i);
+    }
+    if (!i->buffer) {
+      i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+      i->buffer = malloc(i->buffer_slots);
+      i->buffer_len = 0;
+      i->buffer_start = i->state.pos;
+    }
   }
 
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -336,11 +806,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_drop(i);
   }
 
 }
@@ -349,6 +815,7 @@ static void mpc_input_rewind(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
 
+  i->stats.rewinds++;
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
@@ -360,11 +827,11 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_start + (long)i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_start];
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -419,7 +886,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       } else {
         c = getc(i->file);
         if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
+        mpc_input_buffer_push(i, c);
         return c;
       }
 
@@ -444,7 +911,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
       if (i->buffer && mpc_input_buffer_in_range(i)) {
         break;
       } else {
-        ungetc(c, i->file);
+        mpc_input_buffer_push(i, c);
       }
     }
     default: { break; }
@@ -456,21 +923,28 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
   if (i->type == MPC_INPUT_PIPE
   &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    mpc_input_buffer_push(i, c);
   }
 
   i->last = c;
   i->state.pos++;
-  i->state.col++;
 
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
+  if (i->type == MPC_INPUT_PIPE
+  &&  i->buffer && i->marks_num == 0 && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_drop(i);
+  }
+
+  if (!(i->mode & MPC_PARSE_NO_POS)) {
+    i->state.col++;
+    if (c == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
   }
 
-  if (o) {
+  if (o && i->spans) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -500,18 +974,29 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** Character classes are a 256 bit set tested with
+** one lookup rather than a scan of the class string.
+** The terminating byte is never a member.
+*/
+
+#define MPC_CLASS_HAS(s, c) ((s)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+#define MPC_CLASS_ADD(s, c) ((s)[(unsigned char)(c) >> 3] |= (unsigned char)(1 << ((unsigned char)(c) & 7)))
+
+static unsigned char *mpc_class_new(const char *c, int none) {
+  int b;
+  unsigned char *s = calloc(32, 1);
+  for (b = 1; b < 256; b++) {
+    if ((strchr(c, (char)b) == 0) == none) { MPC_CLASS_ADD(s, b); }
+  }
+  return s;
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *s, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return MPC_CLASS_HAS(s, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -535,6 +1020,11 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
 
+  if (i->spans) {
+    *o = NULL;
+    return 1;
+  }
+
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -662,9 +1152,36 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+static void mpc_err_far(mpc_input_t *i, const char *expected) {
+
+  int j;
+
+  if (i->state.pos < i->far.state.pos) { return; }
+
+  if (i->state.pos > i->far.state.pos) {
+    i->far.state = i->state;
+    i->far.received = mpc_input_peekc(i);
+    i->far.num = 0;
+  }
+
+  for (j = 0; j < i->far.num; j++) {
+    if (i->far.expected[j] == expected) { return; }
+  }
+
+  if (i->far.num == i->far.slots) {
+    i->far.slots = i->far.slots ? i->far.slots * 2 : 8;
+    i->far.expected = realloc((void*)i->far.expected, sizeof(char*) * i->far.slots);
+  }
+  i->far.expected[i->far.num++] = expected;
+}
+
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
   if (i->suppress) { return NULL; }
+  if (i->mode & MPC_PARSE_LAZY_ERRORS) {
+    mpc_err_far(i, expected);
+    return NULL;
+  }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -861,6 +1378,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   if (!prefix) {
     return NULL;
@@ -873,11 +1391,57 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
 
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   mpc_err_t *errs[2];
+  /* Merging with nothing would only copy an error */
+  if (x == NULL && y && !(y->failure && y->expected_num)) { return y; }
+  if (y == NULL && x && !(x->failure && x->expected_num)) { return x; }
   errs[0] = x;
   errs[1] = y;
   return mpc_err_or(i, errs, 2);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? mpc_malloc(i, sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->received = x->received;
+  return y;
+}
+
+static mpc_err_t *mpc_err_far_export(mpc_input_t *i) {
+  int j;
+  mpc_err_t *x;
+  if (i->far.num == 0) { return NULL; }
+  x = mpc_malloc(i, sizeof(mpc_err_t));
+  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
+  strcpy(x->filename, i->filename);
+  x->state = i->far.state;
+  x->expected_num = 0;
+  x->expected = NULL;
+  for (j = 0; j < i->far.num; j++) {
+    if (!mpc_err_contains_expected(i, x, (char*)i->far.expected[j])) {
+      mpc_err_add_expected(i, x, (char*)i->far.expected[j]);
+    }
+  }
+  x->failure = NULL;
+  x->received = i->far.received;
+  return x;
+}
+
 /*
 ** Parser Type
 */
@@ -916,7 +1480,11 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_MATCH      = 29,
+  MPC_TYPE_SET        = 30,
+  MPC_TYPE_SPAN       = 31
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -926,7 +1494,7 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char *set; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -934,9 +1502,16 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
+typedef struct { unsigned char *x; int n; char **ms; unsigned char *skip; } mpc_pdata_set_t;
+
+typedef struct { unsigned char set[32]; int type; int min; int max; int merge; int n; char **ms; unsigned char *skip; } mpc_match_item_t;
+typedef struct { int n; mpc_match_item_t *items; char *expect; int discard; int rewind; } mpc_match_t;
+typedef struct { mpc_parser_t *x; mpc_match_t *m; } mpc_pdata_match_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_span_t;
+
 typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
@@ -955,13 +1530,31 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_set_t set;
+  mpc_pdata_match_t match;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
+typedef struct {
+  char type;
+  int n;
+  int xs;
+  mpc_parser_t *p;
+} mpc_inst_t;
+
+typedef struct {
+  int insts_num;
+  mpc_inst_t *insts;
+  int *xs;
+} mpc_program_t;
+
 struct mpc_parser_t {
   char *name;
   mpc_pdata_t data;
   char type;
   char retained;
+  mpc_stats_t *stats;
+  mpc_program_t *program;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -976,11 +1569,19 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t k, l = 0;
+  if (i->spans) { return NULL; }
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  k = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  for (j = 1; j < n; j++) {
+    l = strlen(xs[j]);
+    memcpy((char*)xs[0] + k, xs[j], l);
+    k += l;
+    mpc_free(i, xs[j]);
+  }
+  ((char*)xs[0])[k] = '\0';
   return xs[0];
 }
 
@@ -1014,7 +1615,13 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a;
+  if (i->mode & MPC_PARSE_AST_ARENA) {
+    if (i->arena == NULL) { i->arena = mpc_ast_arena_new(); }
+    a = mpc_ast_arena_node(i->arena, "", c, strlen(c));
+  } else {
+    a = mpc_ast_new("", c);
+  }
   mpc_free(i, c);
   return a;
 }
@@ -1031,1130 +1638,4395 @@ static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   if (d == free) { mpc_free(i, x); return; }
+  /* Pooled values are let go of with the input anyway */
+  if (d == mpcf_dtor_null) { return; }
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+static mpc_val_t *mpc_parse_lift(mpc_input_t *i, mpc_ctor_t f) {
+  /* Inside a span only empty strings are lifted */
+  if (i->spans) { return NULL; }
+  return f();
+}
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** A merged class reports what the alternatives it
+** replaced would have. For each next byte `skip`
+** counts the expectations of those tried before
+** one matched, or all of them if none did.
+*/
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+static int mpc_parse_set(mpc_input_t *i, mpc_parser_t *p, char **o, mpc_err_t **e) {
+  int j, n = p->data.set.skip[(unsigned char)mpc_input_peekc(i)];
+  for (j = 0; j < n; j++) {
+    *e = mpc_err_merge(i, *e, mpc_err_new(i, p->data.set.ms[j]));
+  }
+  return mpc_input_class(i, p->data.set.x, o);
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+/*
+** The set of bytes a single character parser
+** accepts, for parsers whose result depends on
+** nothing but the next byte.
+*/
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+static int mpc_class_of(mpc_parser_t *x, unsigned char *set) {
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  int b;
+  char c;
+
+  switch (x->type) {
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF: memcpy(set, x->data.string.set, 32); return 1;
+    case MPC_TYPE_SET:    memcpy(set, x->data.set.x, 32);      return 1;
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE: break;
+    default: return 0;
   }
 
-  switch (p->type) {
+  memset(set, 0, 32);
+  for (b = 1; b < 256; b++) {
+    c = (char)b;
+    if ((x->type == MPC_TYPE_ANY)
+    ||  (x->type == MPC_TYPE_SINGLE && c == x->data.single.x)
+    ||  (x->type == MPC_TYPE_RANGE && c >= x->data.range.x && c <= x->data.range.y)) {
+      MPC_CLASS_ADD(set, b);
+    }
+  }
 
-    /* Basic Parsers */
+  return 1;
+}
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+/*
+** Regex Matcher
+**
+** Most regular expressions come out of `mpc_re`
+** as a string fold over a sequence of character
+** classes, each of them maybe repeated, and so do
+** many hand written tokens and the whitespace which
+** `mpc_tok` and `mpc_strip` skip. `mpc_optimise`
+** compiles those to a table of byte sets which is
+** run over string input with one lookup per byte.
+**
+** PEG repetition is greedy and never gives back
+** what it consumed, so each item simply takes
+** bytes while they are in its set. Errors the
+** combinators would merge or return are made at
+** the same positions, so the outcome is exactly
+** that of the parser compiled, which is kept to be
+** run on other kinds of input.
+**
+** Expectations and an `mpcf_free` around the
+** sequence are folded in as well, so skipping
+** whitespace allocates nothing.
+*/
 
-    /* Other parsers */
+enum {
+  MPC_MATCH_ITEMS_MAX = 32
+};
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+enum {
+  MPC_MATCH_MERGE_NONE   = 0,
+  MPC_MATCH_MERGE_ALWAYS = 1,
+  MPC_MATCH_MERGE_EMPTY  = 2
+};
 
-    /* Application Parsers */
+static int mpc_match_class(mpc_parser_t *p, mpc_match_item_t *it) {
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+  mpc_parser_t *x = p;
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  /* Only the outermost expectation is ever reported */
+  while (!x->retained && x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if (x->retained || !mpc_class_of(x, it->set)) { return 0; }
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  it->skip = NULL;
+  if (p->type == MPC_TYPE_EXPECT) {
+    it->n = 1;
+    it->ms = &p->data.expect.m;
+  } else if (p->type == MPC_TYPE_SET) {
+    it->n = p->data.set.n;
+    it->ms = p->data.set.ms;
+    it->skip = p->data.set.skip;
+  } else {
+    it->n = 0;
+    it->ms = NULL;
+  }
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  return 1;
+}
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+static int mpc_match_item(mpc_parser_t *p, mpc_match_item_t *it) {
 
-    /* Optional Parsers */
+  if (p->retained) { return 0; }
 
-    /* TODO: Update Not Error Message */
+  it->type = p->type;
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  switch (p->type) {
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+    case MPC_TYPE_EXPECT:
+      it->min = 1; it->max = 1; it->merge = MPC_MATCH_MERGE_NONE;
+      return mpc_match_class(p, it);
 
-    /* Repeat Parsers */
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      it->min = 0; it->max = 1; it->merge = MPC_MATCH_MERGE_EMPTY;
+      return mpc_match_class(p->data.not.x, it);
 
     case MPC_TYPE_MANY:
-
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      if (p->type == MPC_TYPE_COUNT) {
+        it->min = p->data.repeat.n; it->max = p->data.repeat.n; it->merge = MPC_MATCH_MERGE_NONE;
+      } else {
+        it->min = p->type == MPC_TYPE_MANY1; it->max = -1; it->merge = MPC_MATCH_MERGE_ALWAYS;
       }
+      return mpc_match_class(p->data.repeat.x, it);
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+    default: return 0;
+  }
+}
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+static mpc_match_t *mpc_match_new(mpc_parser_t *p) {
 
-    case MPC_TYPE_MANY1:
+  int j, k, n, discard = 0;
+  char *expect = NULL;
+  mpc_parser_t **xs;
+  mpc_match_item_t items[MPC_MATCH_ITEMS_MAX];
+  mpc_match_t *m;
+
+  /* Wrappers which only rename the error or drop the output */
+  while (p->type == MPC_TYPE_EXPECT
+  ||    (p->type == MPC_TYPE_APPLY && p->data.apply.f == mpcf_free)) {
+    if (p->type == MPC_TYPE_EXPECT) {
+      if (expect == NULL) { expect = p->data.expect.m; }
+      p = p->data.expect.x;
+    } else {
+      discard = 1;
+      p = p->data.apply.x;
+    }
+    if (p->retained) { return NULL; }
+  }
 
-      results = results_stk;
+  if (p->type == MPC_TYPE_AND) {
+    if (p->data.and.f != mpcf_strfold) { return NULL; }
+    n = p->data.and.n;
+    xs = p->data.and.xs;
+  } else {
+    n = 1;
+    xs = &p;
+  }
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+  for (j = 0, k = 0; j < n; j++) {
+    if (!xs[j]->retained
+    &&  xs[j]->type == MPC_TYPE_LIFT
+    &&  xs[j]->data.lift.lf == mpcf_ctor_str) { continue; }
+    if (k == MPC_MATCH_ITEMS_MAX || !mpc_match_item(xs[j], &items[k])) { return NULL; }
+    k++;
+  }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+  /* A single character is already one primitive */
+  if (k == 0 || (k == 1 && items[0].min == 1 && items[0].max == 1)) { return NULL; }
+
+  m = malloc(sizeof(mpc_match_t));
+  m->n = k;
+  m->items = malloc(sizeof(mpc_match_item_t) * k);
+  for (j = 0; j < k; j++) {
+    m->items[j] = items[j];
+    m->items[j].ms = malloc(sizeof(char*) * items[j].n);
+    for (n = 0; n < items[j].n; n++) {
+      m->items[j].ms[n] = malloc(strlen(items[j].ms[n]) + 1);
+      strcpy(m->items[j].ms[n], items[j].ms[n]);
+    }
+    if (items[j].skip) {
+      m->items[j].skip = malloc(256);
+      memcpy(m->items[j].skip, items[j].skip, 256);
+    }
+  }
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+  m->expect = NULL;
+  if (expect) {
+    m->expect = malloc(strlen(expect) + 1);
+    strcpy(m->expect, expect);
+  }
+  m->discard = discard;
+  m->rewind = p->type == MPC_TYPE_AND;
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  return m;
+}
 
-    case MPC_TYPE_COUNT:
+static void mpc_match_delete(mpc_match_t *m) {
+  int j, k;
+  if (m == NULL) { return; }
+  for (j = 0; j < m->n; j++) {
+    for (k = 0; k < m->items[j].n; k++) { free(m->items[j].ms[k]); }
+    free(m->items[j].ms);
+    free(m->items[j].skip);
+  }
+  free(m->items);
+  free(m->expect);
+  free(m);
+}
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+static mpc_err_t *mpc_match_error(mpc_input_t *i, mpc_match_item_t *it, mpc_err_t **e) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  int k;
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  /* An expectation returns its error, a class set merges its own */
+  if (it->skip == NULL && it->n == 1) { return mpc_err_new(i, it->ms[0]); }
 
-    /* Combinatory Parsers */
+  for (k = 0; k < it->n; k++) { *e = mpc_err_merge(i, *e, mpc_err_new(i, it->ms[k])); }
+  return NULL;
+}
 
-    case MPC_TYPE_OR:
+static const unsigned char *mpc_match_scan(mpc_match_t *m, const unsigned char *t, int *counts) {
+  int j, k;
+  mpc_match_item_t *it;
+  for (j = 0; j < m->n; j++) {
+    it = &m->items[j];
+    for (k = 0; (it->max < 0 || k < it->max) && MPC_CLASS_HAS(it->set, *t); k++) { t++; }
+    counts[j] = k;
+    if (k < it->min) { break; }
+  }
+  return t;
+}
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+static int mpc_parse_match(mpc_input_t *i, mpc_match_t *m, mpc_result_t *r, mpc_err_t **e) {
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+  int j, k, n;
+  int counts[MPC_MATCH_ITEMS_MAX];
+  const unsigned char *s, *t;
+  mpc_state_t state;
+  char last;
+  mpc_match_item_t *it;
+  mpc_err_t *x;
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+  if (i->type != MPC_INPUT_STRING) {
+    i->stats.match_fallbacks++;
+    return -1;
+  }
+
+  i->stats.match_runs++;
+
+  /* Decide how far each item gets without touching the input */
+  s = (const unsigned char*)i->string + i->state.pos;
+  t = mpc_match_scan(m, s, counts);
+
+  state = i->state;
+  last = i->last;
+  if (m->expect) { mpc_input_suppress_enable(i); }
+
+  /* Then consume it, making the errors the combinators would have along the way */
+  for (j = 0; j < m->n; j++) {
+    it = &m->items[j];
+    k = 0;
+    /* Without positions to keep or errors to make the item is passed over at once */
+    if ((i->mode & MPC_PARSE_NO_POS) && it->skip == NULL && counts[j] > 0) {
+      i->state.pos += counts[j];
+      i->last = i->string[i->state.pos-1];
+      k = counts[j];
+    }
+    for (; k < counts[j]; k++) {
+      for (n = 0; it->skip && n < it->skip[(unsigned char)i->string[i->state.pos]]; n++) {
+        *e = mpc_err_merge(i, *e, mpc_err_new(i, it->ms[n]));
+      }
+      i->last = i->string[i->state.pos++];
+      if (!(i->mode & MPC_PARSE_NO_POS)) {
+        i->state.col++;
+        if (i->last == '\n') {
+          i->state.col = 0;
+          i->state.row++;
         }
       }
+    }
+    if (counts[j] < it->min) { break; }
+    if (it->merge == MPC_MATCH_MERGE_ALWAYS
+    || (it->merge == MPC_MATCH_MERGE_EMPTY && counts[j] == 0)) {
+      x = mpc_match_error(i, it, e);
+      *e = mpc_err_merge(i, *e, x);
+    }
+  }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    case MPC_TYPE_AND:
+  if (j < m->n) {
+    x = mpc_match_error(i, it, e);
+    if (it->type == MPC_TYPE_MANY1) { x = mpc_err_many1(i, x); }
+    if (it->type == MPC_TYPE_COUNT) { x = mpc_err_count(i, x, it->min); }
+    if (m->rewind && i->backtrack > 0) {
+      i->stats.rewinds++;
+      i->state = state;
+      i->last = last;
+    }
+    if (m->expect) {
+      mpc_input_suppress_disable(i);
+      x = mpc_err_new(i, m->expect);
+    }
+    r->error = x;
+    return 0;
+  }
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+  if (m->expect) { mpc_input_suppress_disable(i); }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+  if (m->discard || i->spans) {
+    r->output = NULL;
+    return 1;
+  }
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  r->output = mpc_malloc(i, (size_t)(t - s) + 1);
+  memcpy(r->output, s, (size_t)(t - s));
+  ((char*)r->output)[t - s] = '\0';
+  return 1;
+}
 
-    /* End */
+/*
+** Token Spans
+**
+** The text a string fold over input characters
+** puts together is just the input it consumed. So
+** below a span node parsers build no outputs at
+** all, and the text is copied out of the input in
+** one go at the end. That only holds as long as
+** failed alternatives give back what they took, so
+** spans are only used for string input parsed with
+** backtracking on.
+*/
 
-    default:
+static int mpc_span_active(mpc_input_t *i) {
+  return i->type == MPC_INPUT_STRING && i->backtrack > 0;
+}
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+static char *mpc_input_span(mpc_input_t *i) {
+  char *o = NULL;
+  long start = i->marks[i->marks_num-1].pos;
+  if (!i->spans) {
+    o = mpc_malloc(i, (size_t)(i->state.pos - start) + 1);
+    memcpy(o, i->string + start, (size_t)(i->state.pos - start));
+    o[i->state.pos - start] = '\0';
   }
-
-  return 0;
-
+  mpc_input_unmark(i);
+  return o;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+enum {
+  MPC_PARSE_STACK_MIN = 4
+};
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
-  } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
-  }
-  return x;
-}
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
+/*
+** Errors merged into the running error while a
+** parser was tried are already part of it by the
+** time its result is reused, and merging the same
+** errors twice changes nothing, so a memoised
+** result only needs to restore the input state
+** and hand back its own output or error.
+**
+** Grammars repeat the same construction for each
+** mention of a rule, so unnamed parsers are keyed
+** on their structure and any two that would parse
+** identically share entries.
+*/
 
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static int mpc_memo_active(mpc_input_t *i) {
+  return (i->mode & MPC_PARSE_PACKRAT)
+    && i->type == MPC_INPUT_STRING
+    && i->backtrack > 0
+    && i->spans == 0;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static int mpc_memo_worth(mpc_parser_t *p) {
+  return p->retained
+    || p->type == MPC_TYPE_AND
+    || p->type == MPC_TYPE_OR
+    || p->type == MPC_TYPE_APPLY
+    || p->type == MPC_TYPE_APPLY_TO
+    || p->type == MPC_TYPE_EXPECT;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
+static unsigned long mpc_memo_hash(mpc_parser_t *p, int depth) {
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  int j;
+  unsigned long h = (unsigned long)p->type;
 
-  FILE *f = fopen(filename, "rb");
-  int res;
+  if (p->retained) { return (unsigned long)((size_t)p >> 4); }
+  if (depth == 0) { return h; }
 
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     return h * 31 + mpc_memo_hash(p->data.expect.x, depth-1);
+    case MPC_TYPE_APPLY:      return h * 31 + mpc_memo_hash(p->data.apply.x, depth-1);
+    case MPC_TYPE_APPLY_TO:   return h * 31 + mpc_memo_hash(p->data.apply_to.x, depth-1);
+    case MPC_TYPE_CHECK:      return h * 31 + mpc_memo_hash(p->data.check.x, depth-1);
+    case MPC_TYPE_CHECK_WITH: return h * 31 + mpc_memo_hash(p->data.check_with.x, depth-1);
+    case MPC_TYPE_PREDICT:    return h * 31 + mpc_memo_hash(p->data.predict.x, depth-1);
+    case MPC_TYPE_MATCH:      return h * 31 + mpc_memo_hash(p->data.match.x, depth-1);
+    case MPC_TYPE_SPAN:       return h * 31 + mpc_memo_hash(p->data.span.x, depth-1);
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      return h * 31 + mpc_memo_hash(p->data.not.x, depth-1);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      return h * 31 + mpc_memo_hash(p->data.repeat.x, depth-1);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { h = h * 31 + mpc_memo_hash(p->data.or.xs[j], depth-1); }
+      return h;
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { h = h * 31 + mpc_memo_hash(p->data.and.xs[j], depth-1); }
+      return h;
+    default: return h;
   }
-
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
 }
 
-/*
-** Building a Parser
-*/
+static int mpc_memo_equal(mpc_parser_t *a, mpc_parser_t *b) {
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+  int j;
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+  if (a == b) { return 1; }
+  if (a->retained || b->retained || a->type != b->type) { return 0; }
 
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
-  }
-  free(p->data.or.xs);
+  switch (a->type) {
 
-}
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI: return 1;
+
+    case MPC_TYPE_FAIL:     return strcmp(a->data.fail.m, b->data.fail.m) == 0;
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL: return a->data.lift.lf == b->data.lift.lf && a->data.lift.x == b->data.lift.x;
+    case MPC_TYPE_ANCHOR:   return a->data.anchor.f == b->data.anchor.f;
+    case MPC_TYPE_SINGLE:   return a->data.single.x == b->data.single.x;
+    case MPC_TYPE_RANGE:    return a->data.range.x == b->data.range.x && a->data.range.y == b->data.range.y;
+    case MPC_TYPE_SATISFY:  return a->data.satisfy.f == b->data.satisfy.f;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:   return strcmp(a->data.string.x, b->data.string.x) == 0;
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+    case MPC_TYPE_EXPECT:
+      return strcmp(a->data.expect.m, b->data.expect.m) == 0
+        && mpc_memo_equal(a->data.expect.x, b->data.expect.x);
+    case MPC_TYPE_APPLY:
+      return a->data.apply.f == b->data.apply.f
+        && mpc_memo_equal(a->data.apply.x, b->data.apply.x);
+    case MPC_TYPE_APPLY_TO:
+      return a->data.apply_to.f == b->data.apply_to.f
+        && a->data.apply_to.d == b->data.apply_to.d
+        && mpc_memo_equal(a->data.apply_to.x, b->data.apply_to.x);
+    case MPC_TYPE_CHECK:
+      return a->data.check.f == b->data.check.f
+        && a->data.check.dx == b->data.check.dx
+        && strcmp(a->data.check.e, b->data.check.e) == 0
+        && mpc_memo_equal(a->data.check.x, b->data.check.x);
+    case MPC_TYPE_CHECK_WITH:
+      return a->data.check_with.f == b->data.check_with.f
+        && a->data.check_with.d == b->data.check_with.d
+        && a->data.check_with.dx == b->data.check_with.dx
+        && strcmp(a->data.check_with.e, b->data.check_with.e) == 0
+        && mpc_memo_equal(a->data.check_with.x, b->data.check_with.x);
+    case MPC_TYPE_PREDICT:
+      return mpc_memo_equal(a->data.predict.x, b->data.predict.x);
+    case MPC_TYPE_MATCH:
+      return mpc_memo_equal(a->data.match.x, b->data.match.x);
+    case MPC_TYPE_SPAN:
+      return mpc_memo_equal(a->data.span.x, b->data.span.x);
+    case MPC_TYPE_SET:
+      if (a->data.set.n != b->data.set.n
+      ||  memcmp(a->data.set.x, b->data.set.x, 32) != 0
+      ||  memcmp(a->data.set.skip, b->data.set.skip, 256) != 0) { return 0; }
+      for (j = 0; j < a->data.set.n; j++) {
+        if (strcmp(a->data.set.ms[j], b->data.set.ms[j]) != 0) { return 0; }
+      }
+      return 1;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return a->data.not.lf == b->data.not.lf
+        && a->data.not.dx == b->data.not.dx
+        && mpc_memo_equal(a->data.not.x, b->data.not.x);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return a->data.repeat.n == b->data.repeat.n
+        && a->data.repeat.f == b->data.repeat.f
+        && a->data.repeat.dx == b->data.repeat.dx
+        && mpc_memo_equal(a->data.repeat.x, b->data.repeat.x);
 
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
-  }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
+    case MPC_TYPE_OR:
+      if (a->data.or.n != b->data.or.n) { return 0; }
+      for (j = 0; j < a->data.or.n; j++) {
+        if (!mpc_memo_equal(a->data.or.xs[j], b->data.or.xs[j])) { return 0; }
+      }
+      return 1;
+
+    case MPC_TYPE_AND:
+      if (a->data.and.n != b->data.and.n || a->data.and.f != b->data.and.f) { return 0; }
+      for (j = 0; j < a->data.and.n; j++) {
+        if (!mpc_memo_equal(a->data.and.xs[j], b->data.and.xs[j])) { return 0; }
+      }
+      for (j = 0; j < a->data.and.n-1; j++) {
+        if (a->data.and.dxs[j] != b->data.and.dxs[j]) { return 0; }
+      }
+      return 1;
 
+    default: return 0;
+  }
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+enum {
+  MPC_MEMO_HASH_DEPTH = 3
+};
 
-  if (p->retained && !force) { return; }
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, unsigned long h, long pos) {
+  return &i->memo[(h * 2654435761UL + (unsigned long)pos) % MPC_PARSE_MEMO_SLOTS];
+}
 
-  switch (p->type) {
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success) {
+    mpc_parse_dtor(i, m->dtor, m->output);
+    i->memo_values--;
+  } else {
+    mpc_err_delete_internal(i, m->error);
+  }
+  m->p = NULL;
+}
 
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+static void mpc_memo_store(mpc_input_t *i, mpc_memo_t *entry) {
+  mpc_memo_t *m;
+  if (i->memo == NULL) { i->memo = calloc(MPC_PARSE_MEMO_SLOTS, sizeof(mpc_memo_t)); }
+  m = mpc_memo_slot(i, mpc_memo_hash(entry->p, MPC_MEMO_HASH_DEPTH), entry->pos);
+  if (m->p) { i->stats.memo_evictions++; }
+  mpc_memo_clear(i, m);
+  *m = *entry;
+  if (m->success) { i->memo_values++; }
+  i->stats.memo_stores++;
+}
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x);
-      break;
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p) {
+  mpc_memo_t *m;
+  if (i->memo == NULL) { return NULL; }
+  m = mpc_memo_slot(i, mpc_memo_hash(p, MPC_MEMO_HASH_DEPTH), i->state.pos);
+  if (m->p == NULL
+  ||  m->pos != i->state.pos
+  ||  m->suppress != (i->suppress > 0)
+  ||  !mpc_memo_equal(m->p, p)) { return NULL; }
+  return m;
+}
 
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+static void mpc_memo_delete(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_PARSE_MEMO_SLOTS; j++) { mpc_memo_clear(i, &i->memo[j]); }
+  free(i->memo);
+  i->memo = NULL;
+}
 
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
+/*
+** When a sequence fails, the outputs of the parts
+** that matched before the failing one are kept in
+** the memo instead of being destroyed, as the next
+** alternative will often start the same way.
+*/
 
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
+typedef struct {
+  mpc_state_t state;
+  char last;
+} mpc_memo_mark_t;
 
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
+static void mpc_memo_salvage(mpc_input_t *i, mpc_parser_t *p, mpc_memo_mark_t *start, mpc_memo_mark_t *end, mpc_dtor_t d, mpc_val_t *x) {
+  mpc_memo_t entry;
+  entry.p = p;
+  entry.pos = start->state.pos;
+  entry.suppress = i->suppress > 0;
+  entry.success = 1;
+  entry.end = end->state;
+  entry.last = end->last;
+  entry.output = x;
+  entry.dtor = d;
+  entry.error = NULL;
+  mpc_memo_store(i, &entry);
+}
 
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
 
-    case MPC_TYPE_CHECK:
-      mpc_undefine_unretained(p->data.check.x, 0);
-      free(p->data.check.e);
-      break;
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-    case MPC_TYPE_CHECK_WITH:
-      mpc_undefine_unretained(p->data.check_with.x, 0);
-      free(p->data.check_with.e);
-      break;
+  mpc_memo_t *m, entry;
 
-    default: break;
+  if (!mpc_memo_active(i)
+  || !(p->retained || (i->memo_values > 0 && mpc_memo_worth(p)))) {
+    return mpc_parse_node(i, p, r, e, depth);
   }
 
-  if (!force) {
-    free(p->name);
-    free(p);
+  i->stats.memo_lookups++;
+
+  m = mpc_memo_find(i, p);
+  if (m) {
+    i->stats.memo_hits++;
+    i->state = m->end;
+    i->last = m->last;
+    if (m->success) {
+      m->p = NULL;
+      i->memo_values--;
+      MPC_SUCCESS(m->output);
+    } else {
+      MPC_FAILURE(mpc_err_copy(i, m->error));
+    }
   }
 
+  entry.p = p;
+  entry.pos = i->state.pos;
+  entry.suppress = i->suppress > 0;
+
+  if (mpc_parse_node(i, p, r, e, depth)) { return 1; }
+  if (!p->retained) { return 0; }
+
+  entry.success = 0;
+  entry.end = i->state;
+  entry.last = i->last;
+  entry.output = NULL;
+  entry.dtor = NULL;
+  entry.error = mpc_err_copy(i, r->error);
+  mpc_memo_store(i, &entry);
+  return 0;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+static int mpc_profiled(mpc_input_t *i, mpc_parser_t *p) {
+  return (i->mode & MPC_PARSE_PROFILE) && p->name;
+}
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    }
+static void mpc_profile_enter(mpc_input_t *i, mpc_parser_t *p) {
 
-    free(p->name);
-    free(p);
+  mpc_prof_t *f;
 
-  } else {
-    mpc_undefine_unretained(p, 0);
+  if (p->stats == NULL) { p->stats = calloc(1, sizeof(mpc_stats_t)); }
+
+  if (i->prof_num == i->prof_slots) {
+    i->prof_slots = i->prof_slots ? i->prof_slots * 2 : 64;
+    i->prof = realloc(i->prof, sizeof(mpc_prof_t) * i->prof_slots);
   }
+
+  f = &i->prof[i->prof_num++];
+  f->p = p;
+  f->pos = i->state.pos;
+  f->rewinds = i->stats.rewinds;
+  if (p->stats->active++ == 0) { f->start = clock(); }
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
+static void mpc_profile_exit(mpc_input_t *i, int ok) {
+
+  mpc_prof_t *f = &i->prof[--i->prof_num];
+  mpc_stats_t *s = f->p->stats;
+
+  s->calls++;
+  s->successes += ok;
+  if (--s->active > 0) { return; }
+
+  s->ticks += clock() - f->start;
+  s->backtracks += i->stats.rewinds - f->rewinds;
+  if (ok) { s->consumed += i->state.pos - f->pos; }
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
+/* Runs left unfinished, by a feed deleted part way, stop counting */
+static void mpc_profile_unwind(mpc_input_t *i) {
+  while (i->prof_num > 0) { i->prof[--i->prof_num].p->stats->active--; }
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  int x;
+  if (!mpc_profiled(i, p)) { return mpc_parse_memo(i, p, r, e, depth); }
+  mpc_profile_enter(i, p);
+  x = mpc_parse_memo(i, p, r, e, depth);
+  mpc_profile_exit(i, x);
+  return x;
 }
 
-mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-  int i = 0;
-  mpc_parser_t *p;
+/*
+** Each level of nesting here is a call on the C
+** stack, so its depth is capped. Compiled parsers
+** don't recurse and are only held to the stack
+** budget of `mpc_parse_program`.
+*/
 
-  if (a->retained) { return a; }
+#ifndef MPC_MAX_RECURSION_DEPTH
+#define MPC_MAX_RECURSION_DEPTH 1000
+#endif
 
-  p = mpc_undefined();
-  p->retained = a->retained;
-  p->type = a->type;
-  p->data = a->data;
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  if (a->name) {
-    p->name = malloc(strlen(a->name)+1);
-    strcpy(p->name, a->name);
-  }
+  int j = 0, k = 0;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_result_t *results;
+  int results_slots = MPC_PARSE_STACK_MIN;
+  mpc_memo_mark_t marks_stk[MPC_PARSE_STACK_MIN];
+  mpc_memo_mark_t *marks;
+  mpc_err_t *ek = NULL;
 
-  switch (a->type) {
+  if (depth == MPC_MAX_RECURSION_DEPTH)
+  {
+    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  }
 
-    case MPC_TYPE_FAIL:
-      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
-      strcpy(p->data.fail.m, a->data.fail.m);
-    break;
+  switch (p->type) {
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      p->data.string.x = malloc(strlen(a->data.string.x)+1);
-      strcpy(p->data.string.x, a->data.string.x);
-      break;
+    /* Basic Parsers */
 
-    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
-    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
-    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
 
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      p->data.not.x = mpc_copy(a->data.not.x);
-      break;
+    case MPC_TYPE_SET:     MPC_PRIMITIVE(mpc_parse_set(i, p, (char**)&r->output, e));
 
-    case MPC_TYPE_EXPECT:
-      p->data.expect.x = mpc_copy(a->data.expect.x);
-      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
-      strcpy(p->data.expect.m, a->data.expect.m);
-      break;
+    /* Other parsers */
 
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf));
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+    /* Application Parsers */
+
+    case MPC_TYPE_APPLY:
+      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
+      } else {
+        MPC_FAILURE(r->output);
+      }
+
+    case MPC_TYPE_APPLY_TO:
+      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
+        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
+    case MPC_TYPE_CHECK:
+      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
+        if (p->data.check.f(&r->output)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          mpc_parse_dtor(i, p->data.check.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+        }
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
+    case MPC_TYPE_CHECK_WITH:
+      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
+        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          mpc_parse_dtor(i, p->data.check.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+        }
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_enable(i);
+      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_suppress_disable(i);
+        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+      }
+
+    case MPC_TYPE_MATCH:
+      k = p->data.match.m ? mpc_parse_match(i, p->data.match.m, r, e) : -1;
+      if (k >= 0) { return k; }
+      return mpc_parse_run(i, p->data.match.x, r, e, depth+1);
+
+    case MPC_TYPE_SPAN:
+      if (!mpc_span_active(i)) { return mpc_parse_run(i, p->data.span.x, r, e, depth+1); }
+      mpc_input_mark(i);
+      i->spans++;
+      k = mpc_parse_run(i, p->data.span.x, r, e, depth+1);
+      i->spans--;
+      if (k) { MPC_SUCCESS(mpc_input_span(i)); }
+      mpc_input_unmark(i);
+      MPC_FAILURE(r->error);
+
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_disable(i);
+      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
+        mpc_input_backtrack_enable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_backtrack_enable(i);
+        MPC_FAILURE(r->error);
+      }
+
+    /* Optional Parsers */
+
+    /* TODO: Update Not Error Message */
+
+    case MPC_TYPE_NOT:
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        MPC_FAILURE(mpc_err_new(i, "opposite"));
+      } else {
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+      }
+
+    case MPC_TYPE_MAYBE:
+      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+      }
+
+    /* Repeat Parsers */
+
+    case MPC_TYPE_MANY:
+
+      results = results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == MPC_PARSE_STACK_MIN) {
+          results_slots = j + j / 2;
+          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (j >= results_slots) {
+          results_slots = j + j / 2;
+          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+        }
+      }
+
+      *e = mpc_err_merge(i, *e, results[j].error);
+
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    case MPC_TYPE_MANY1:
+
+      results = results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == MPC_PARSE_STACK_MIN) {
+          results_slots = j + j / 2;
+          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (j >= results_slots) {
+          results_slots = j + j / 2;
+          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+        }
+      }
+
+      if (j == 0) {
+        MPC_FAILURE(
+          mpc_err_many1(i, results[j].error);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+
+        *e = mpc_err_merge(i, *e, results[j].error);
+
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
+
+    case MPC_TYPE_COUNT:
+
+      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == p->data.repeat.n) { break; }
+      }
+
+      if (j == p->data.repeat.n) {
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+        for (k = 0; k < j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        }
+        MPC_FAILURE(
+          mpc_err_count(i, results[j].error, p->data.repeat.n);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
+
+    /* Combinatory Parsers */
+
+    case MPC_TYPE_OR:
+
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      /* Try the one alternative able to start with the next byte first */
+      k = p->data.or.first ? p->data.or.first[(unsigned char)mpc_input_peekc(i)] - 1 : -1;
+
+      if (k >= 0) {
+        if (mpc_parse_run(i, p->data.or.xs[k], &results[k], &ek, depth+1)) {
+          if (ek) { *e = mpc_err_merge(i, *e, ek); }
+          MPC_SUCCESS(results[k].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+
+      for (j = 0; j < p->data.or.n; j++) {
+        if (j == k) {
+          if (ek) { *e = mpc_err_merge(i, *e, ek); ek = NULL; }
+          *e = mpc_err_merge(i, *e, results[j].error);
+          continue;
+        }
+        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+          if (j < k) {
+            mpc_err_delete_internal(i, ek);
+            mpc_err_delete_internal(i, results[k].error);
+          }
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        } else {
+          *e = mpc_err_merge(i, *e, results[j].error);
+        }
+      }
+
+      MPC_FAILURE(NULL;
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    case MPC_TYPE_AND:
+
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      marks = NULL;
+      if (mpc_memo_active(i)) {
+        marks = p->data.and.n >= MPC_PARSE_STACK_MIN
+          ? mpc_malloc(i, sizeof(mpc_memo_mark_t) * (p->data.and.n + 1))
+          : marks_stk;
+      }
+
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (marks) { marks[j].state = i->state; marks[j].last = i->last; }
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+          mpc_input_rewind(i);
+          for (k = 0; k < j; k++) {
+            if (marks && mpc_memo_worth(p->data.and.xs[k])) {
+              mpc_memo_salvage(i, p->data.and.xs[k], &marks[k], &marks[k+1], p->data.and.dxs[k], results[k].output);
+            } else {
+              mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+            }
+          }
+          MPC_FAILURE(results[j].error;
+            if (marks != marks_stk) { mpc_free(i, marks); }
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      mpc_input_unmark(i);
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+        if (marks != marks_stk) { mpc_free(i, marks); }
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    /* End */
+
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+
+  return 0;
+
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+/*
+** Parsing Programs
+**
+** A compiled parser is flattened into an array of
+** instructions, one for every parser reachable
+** from it, which name their children by index.
+** The program is run by a loop over an explicit
+** stack of frames rather than by recursion, with
+** the outputs of repeats and sequences gathered
+** on a shared value stack so no node needs its
+** own result array. Each instruction behaves as
+** the matching case of `mpc_parse_node` does.
+**
+** Nesting is limited only by the memory the frame
+** stack may grow to, `MPC_PARSE_STACK_BUDGET` bytes,
+** which is only taken as deeper input needs it.
+*/
+
+#ifndef MPC_PARSE_STACK_BUDGET
+#define MPC_PARSE_STACK_BUDGET (64L * 1024L * 1024L)
+#endif
+
+enum {
+  MPC_PROGRAM_FRAMES_MIN = 64,
+  MPC_PROGRAM_VALUES_MIN = 64
+};
+
+typedef struct {
+  int inst;
+  int j;
+  int base;
+  int k;
+  int acc;
+  mpc_err_t *ek;
+  mpc_err_t *kerr;
+} mpc_frame_t;
+
+typedef struct {
+  mpc_program_t *g;
+  int call;
+  int frames_num;
+  int frames_slots;
+  int values_num;
+  int values_slots;
+  mpc_frame_t *frames;
+  mpc_val_t **values;
+} mpc_machine_t;
+
+static int mpc_program_arity(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+    case MPC_TYPE_MATCH:
+    case MPC_TYPE_SPAN: return 1;
+    case MPC_TYPE_OR:  return p->data.or.n;
+    case MPC_TYPE_AND: return p->data.and.n;
+    default: return 0;
+  }
+}
+
+static mpc_parser_t *mpc_program_child(mpc_parser_t *p, int j) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     return p->data.expect.x;
+    case MPC_TYPE_APPLY:      return p->data.apply.x;
+    case MPC_TYPE_APPLY_TO:   return p->data.apply_to.x;
+    case MPC_TYPE_CHECK:      return p->data.check.x;
+    case MPC_TYPE_CHECK_WITH: return p->data.check_with.x;
+    case MPC_TYPE_PREDICT:    return p->data.predict.x;
+    case MPC_TYPE_MATCH:      return p->data.match.x;
+    case MPC_TYPE_SPAN:       return p->data.span.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      return p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      return p->data.repeat.x;
+    case MPC_TYPE_OR:         return p->data.or.xs[j];
+    case MPC_TYPE_AND:        return p->data.and.xs[j];
+    default: return NULL;
+  }
+}
+
+typedef struct {
+  mpc_parser_t **ps;
+  int *ids;
+  int slots;
+} mpc_program_index_t;
+
+static int mpc_program_find(mpc_program_index_t *t, mpc_parser_t *p) {
+  unsigned long h = (unsigned long)((size_t)p >> 4) * 2654435761UL;
+  int k = (int)(h & (unsigned long)(t->slots - 1));
+  while (t->ps[k] && t->ps[k] != p) { k = (k + 1) & (t->slots - 1); }
+  return k;
+}
+
+static int mpc_program_add(mpc_program_t *g, mpc_program_index_t *t, mpc_parser_t *p) {
+
+  int k, j, slots;
+  mpc_parser_t **ps;
+  int *ids;
+
+  k = mpc_program_find(t, p);
+  if (t->ps[k]) { return t->ids[k]; }
+
+  t->ps[k] = p;
+  t->ids[k] = g->insts_num;
+
+  g->insts_num++;
+  g->insts = realloc(g->insts, sizeof(mpc_inst_t) * g->insts_num);
+  g->insts[g->insts_num-1].p = p;
+
+  /* Keep the index at most half full */
+  if (g->insts_num * 2 > t->slots) {
+    ps = t->ps; ids = t->ids; slots = t->slots;
+    t->slots = slots * 2;
+    t->ps = calloc(t->slots, sizeof(mpc_parser_t*));
+    t->ids = malloc(sizeof(int) * t->slots);
+    for (j = 0; j < slots; j++) {
+      if (ps[j] == NULL) { continue; }
+      k = mpc_program_find(t, ps[j]);
+      t->ps[k] = ps[j];
+      t->ids[k] = ids[j];
+    }
+    free(ps); free(ids);
+  }
+
+  return g->insts_num-1;
+}
+
+static void mpc_program_delete(mpc_program_t *g) {
+  if (g == NULL) { return; }
+  free(g->insts);
+  free(g->xs);
+  free(g);
+}
+
+static mpc_program_t *mpc_program_new(mpc_parser_t *p) {
+
+  int j, k, n, x;
+  mpc_program_t *g;
+  mpc_program_index_t t;
+
+  g = malloc(sizeof(mpc_program_t));
+  g->insts_num = 0;
+  g->insts = NULL;
+  g->xs = NULL;
+
+  t.slots = 64;
+  t.ps = calloc(t.slots, sizeof(mpc_parser_t*));
+  t.ids = malloc(sizeof(int) * t.slots);
+
+  /* Instructions are numbered breadth first, so children come after their parents */
+  mpc_program_add(g, &t, p);
+
+  for (k = 0, x = 0; k < g->insts_num; k++) {
+    n = mpc_program_arity(g->insts[k].p);
+    g->insts[k].type = g->insts[k].p->type;
+    g->insts[k].n = n;
+    g->insts[k].xs = x;
+    g->xs = realloc(g->xs, sizeof(int) * (x + n + 1));
+    for (j = 0; j < n; j++) {
+      g->xs[x + j] = mpc_program_add(g, &t, mpc_program_child(g->insts[k].p, j));
+    }
+    x += n;
+  }
+
+  free(t.ps);
+  free(t.ids);
+
+  return g;
+}
+
+void mpc_compile(mpc_parser_t *p) {
+  mpc_program_delete(p->program);
+  p->program = mpc_program_new(p);
+}
+
+static void mpc_machine_init(mpc_machine_t *m, mpc_program_t *g) {
+  m->g = g;
+  m->call = 0;
+  m->frames_num = 0;
+  m->frames_slots = MPC_PROGRAM_FRAMES_MIN;
+  m->values_num = 0;
+  m->values_slots = MPC_PROGRAM_VALUES_MIN;
+  m->frames = malloc(sizeof(mpc_frame_t) * m->frames_slots);
+  m->values = malloc(sizeof(mpc_val_t*) * m->values_slots);
+}
+
+/*
+** A machine stopped part way is dropped by going
+** down its frames as if each child had finished,
+** handing any output made so far to the frame
+** below so it can be freed by whichever parser
+** knows how to.
+*/
+
+static void mpc_machine_abandon(mpc_input_t *i, mpc_machine_t *m) {
+
+  int j, k, has = 0;
+  mpc_val_t *x = NULL;
+  mpc_frame_t *f;
+  mpc_parser_t *p;
+
+  for (j = m->frames_num-1; j >= 0; j--) {
+
+    f = &m->frames[j];
+    p = m->g->insts[f->inst].p;
+    mpc_err_delete_internal(i, f->ek);
+    mpc_err_delete_internal(i, f->kerr);
+
+    switch (p->type) {
+
+      case MPC_TYPE_APPLY:
+        if (has) { x = mpc_parse_apply(i, p->data.apply.f, x); }
+        break;
+
+      case MPC_TYPE_APPLY_TO:
+        if (has) { x = mpc_parse_apply_to(i, p->data.apply_to.f, x, p->data.apply_to.d); }
+        break;
+
+      case MPC_TYPE_CHECK:
+        if (has) { mpc_parse_dtor(i, p->data.check.dx, x); has = 0; }
+        break;
+
+      case MPC_TYPE_CHECK_WITH:
+        if (has) { mpc_parse_dtor(i, p->data.check_with.dx, x); has = 0; }
+        break;
+
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        break;
+
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        break;
+
+      case MPC_TYPE_SPAN:
+        if (mpc_span_active(i)) {
+          i->spans--;
+          if (has) { x = mpc_input_span(i); } else { mpc_input_unmark(i); }
+        }
+        break;
+
+      case MPC_TYPE_NOT:
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        if (has) { mpc_parse_dtor(i, p->data.not.dx, x); has = 0; }
+        break;
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+      case MPC_TYPE_AND:
+        if (has) { m->values[f->base + f->j++] = x; }
+        has = 0;
+        if (p->type == MPC_TYPE_AND) {
+          mpc_input_unmark(i);
+          for (k = 0; k < f->j; k++) { mpc_parse_dtor(i, p->data.and.dxs[k], m->values[f->base + k]); }
+        } else if (p->type == MPC_TYPE_COUNT) {
+          for (k = 0; k < f->j; k++) { mpc_parse_dtor(i, p->data.repeat.dx, m->values[f->base + k]); }
+        } else if (f->j > 0) {
+          /* Repeats have no destructor, so their values go down folded */
+          x = mpc_parse_fold(i, p->data.repeat.f, f->j, m->values + f->base);
+          has = 1;
+        }
+        break;
+
+      default: break;
+    }
+  }
+
+  free(m->frames);
+  free(m->values);
+}
+
+/*
+** While a feed is still waiting on input, an
+** instruction which would look at the end of what
+** has arrived so far waits for more rather than
+** fail there.
+*/
+
+static int mpc_feed_ready(mpc_input_t *i, mpc_inst_t *in) {
+
+  int counts[MPC_MATCH_ITEMS_MAX];
+  long n = i->feed_len - i->state.pos;
+  const char *s = i->string + i->state.pos;
+  mpc_parser_t *p = in->p;
+
+  switch (in->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_SET:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_EOI:
+      return n > 0;
+    case MPC_TYPE_OR:
+      return n > 0 || p->data.or.first == NULL;
+    case MPC_TYPE_STRING:
+      /* Either all of the literal is there or it has already gone wrong */
+      return (long)strlen(p->data.string.x) <= n || strncmp(s, p->data.string.x, (size_t)n) != 0;
+    case MPC_TYPE_MATCH:
+      return p->data.match.m == NULL
+        || (const char*)mpc_match_scan(p->data.match.m, (const unsigned char*)s, counts) < s + n;
+    default:
+      return 1;
+  }
+}
+
+#define MPC_SUCCESS(x) res.output = x; ok = 1
+#define MPC_FAILURE(x) res.error = x; ok = 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { ok = 1; } else { MPC_FAILURE(NULL); }
+#define MPC_CALL(x) call = g->xs[in->xs + (x)]
+#define MPC_ACC(f) ((f)->acc < 0 ? e : &frames[(f)->acc].ek)
+
+static int mpc_machine_run(mpc_input_t *i, mpc_machine_t *m, mpc_result_t *r, mpc_err_t **e) {
+
+  int k, ok = 0, call = m->call;
+  int frames_num = m->frames_num, frames_slots = m->frames_slots;
+  int values_num = m->values_num, values_slots = m->values_slots;
+  mpc_frame_t *frames = m->frames;
+  mpc_val_t **values = m->values;
+  mpc_program_t *g = m->g;
+  mpc_frame_t *f, *t;
+  mpc_inst_t *in;
+  mpc_parser_t *p;
+  mpc_result_t res;
+
+  res.output = NULL;
+
+  for (;;) {
+
+    /* Enter instructions until one finishes without needing a child */
+
+    while (call >= 0) {
+
+      in = &g->insts[call];
+      p = in->p;
+
+      /* Stop with everything in place until the next chunk arrives */
+      if (i->feeding && !mpc_feed_ready(i, in)) {
+        m->call = call;
+        m->frames_num = frames_num;
+        m->frames_slots = frames_slots;
+        m->values_num = values_num;
+        m->values_slots = values_slots;
+        m->frames = frames;
+        m->values = values;
+        return -1;
+      }
+
+      if (in->n > 0) {
+        if (frames_num == frames_slots) {
+          if ((long)sizeof(mpc_frame_t) * frames_slots * 2 > MPC_PARSE_STACK_BUDGET) {
+            MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+            call = -1;
+            break;
+          }
+          frames_slots *= 2;
+          frames = realloc(frames, sizeof(mpc_frame_t) * frames_slots);
+        }
+        f = &frames[frames_num];
+        f->inst = call;
+        f->j = 0;
+        f->base = values_num;
+        f->k = -1;
+        f->acc = -1;
+        f->ek = NULL;
+        f->kerr = NULL;
+        /* Children of an alternative being tried first merge into its own errors */
+        if (frames_num > 0) {
+          t = &frames[frames_num-1];
+          f->acc = t->k >= 0 && t->j < 0 ? frames_num-1 : t->acc;
+        }
+        frames_num++;
+      }
+
+      if (mpc_profiled(i, p)) { mpc_profile_enter(i, p); }
+
+      switch (in->type) {
+
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&res.output)); break;
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&res.output)); break;
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&res.output)); break;
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&res.output)); break;
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&res.output)); break;
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&res.output)); break;
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&res.output)); break;
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&res.output)); break;
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&res.output)); break;
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&res.output)); break;
+
+        case MPC_TYPE_SET:
+          /* Errors go wherever those of a child of the waiting frame would */
+          t = frames_num > 0 ? &frames[frames_num-1] : NULL;
+          MPC_PRIMITIVE(mpc_parse_set(i, p, (char**)&res.output,
+            t == NULL ? e : t->k >= 0 && t->j < 0 ? &t->ek : MPC_ACC(t)));
+          break;
+
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!")); break;
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL); break;
+        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m)); break;
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf)); break;
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x); break;
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i)); break;
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_APPLY_TO:
+        case MPC_TYPE_CHECK:
+        case MPC_TYPE_CHECK_WITH:
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_PREDICT:
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_MATCH:
+          k = p->data.match.m ? mpc_parse_match(i, p->data.match.m, &res, MPC_ACC(&frames[frames_num-1])) : -1;
+          if (k >= 0) {
+            ok = k;
+            break;
+          }
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_SPAN:
+          if (mpc_span_active(i)) {
+            mpc_input_mark(i);
+            i->spans++;
+          }
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(0);
+          continue;
+
+        case MPC_TYPE_OR:
+          if (in->n == 0) { MPC_SUCCESS(NULL); break; }
+          f = &frames[frames_num-1];
+          f->k = p->data.or.first ? p->data.or.first[(unsigned char)mpc_input_peekc(i)] - 1 : -1;
+          if (f->k >= 0) { f->j = -1; MPC_CALL(f->k); } else { MPC_CALL(0); }
+          continue;
+
+        case MPC_TYPE_AND:
+          if (in->n == 0) { MPC_SUCCESS(NULL); break; }
+          mpc_input_mark(i);
+          MPC_CALL(0);
+          continue;
+
+        default:
+          MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+          break;
+      }
+
+      /* Instructions without children finish here, the rest when their frame is done */
+      if (in->n == 0 && mpc_profiled(i, p)) { mpc_profile_exit(i, ok); }
+
+      call = -1;
+    }
+
+    /* Hand the result to the frame waiting on it */
+
+    if (frames_num == 0) { break; }
+
+    f = &frames[frames_num-1];
+    in = &g->insts[f->inst];
+    p = in->p;
+
+    switch (in->type) {
+
+      case MPC_TYPE_APPLY:
+        if (ok) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, res.output)); }
+        break;
+
+      case MPC_TYPE_APPLY_TO:
+        if (ok) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, res.output, p->data.apply_to.d)); }
+        break;
+
+      case MPC_TYPE_CHECK:
+        if (ok && !p->data.check.f(&res.output)) {
+          mpc_parse_dtor(i, p->data.check.dx, res.output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+        }
+        break;
+
+      case MPC_TYPE_CHECK_WITH:
+        if (ok && !p->data.check_with.f(&res.output, p->data.check_with.d)) {
+          mpc_parse_dtor(i, p->data.check_with.dx, res.output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+        }
+        break;
+
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        if (!ok) { MPC_FAILURE(mpc_err_new(i, p->data.expect.m)); }
+        break;
+
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        break;
+
+      case MPC_TYPE_SPAN:
+        if (mpc_span_active(i)) {
+          i->spans--;
+          if (ok) { MPC_SUCCESS(mpc_input_span(i)); }
+          else { mpc_input_unmark(i); }
+        }
+        break;
+
+      case MPC_TYPE_NOT:
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, p->data.not.dx, res.output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        } else {
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+        }
+        break;
+
+      case MPC_TYPE_MAYBE:
+        if (!ok) {
+          *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), res.error);
+          MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+        }
+        break;
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+      case MPC_TYPE_AND:
+
+        if (ok) {
+          if (values_num == values_slots) {
+            values_slots *= 2;
+            values = realloc(values, sizeof(mpc_val_t*) * values_slots);
+          }
+          values[values_num++] = res.output;
+          f->j++;
+          if (in->type == MPC_TYPE_AND && f->j < in->n) { MPC_CALL(f->j); continue; }
+          if (in->type == MPC_TYPE_COUNT && f->j != p->data.repeat.n) { MPC_CALL(0); continue; }
+          if (in->type == MPC_TYPE_MANY || in->type == MPC_TYPE_MANY1) { MPC_CALL(0); continue; }
+        }
+
+        if (in->type == MPC_TYPE_AND) {
+          if (ok) {
+            mpc_input_unmark(i);
+            MPC_SUCCESS(mpc_parse_fold(i, p->data.and.f, f->j, values + f->base));
+          } else {
+            mpc_input_rewind(i);
+            for (k = 0; k < f->j; k++) {
+              mpc_parse_dtor(i, p->data.and.dxs[k], values[f->base + k]);
+            }
+          }
+        }
+
+        else if (in->type == MPC_TYPE_COUNT) {
+          if (ok) {
+            MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->j, values + f->base));
+          } else {
+            for (k = 0; k < f->j; k++) {
+              mpc_parse_dtor(i, p->data.repeat.dx, values[f->base + k]);
+            }
+            MPC_FAILURE(mpc_err_count(i, res.error, p->data.repeat.n));
+          }
+        }
+
+        else if (in->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, res.error));
+        }
+
+        else {
+          *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), res.error);
+          MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->j, values + f->base));
+        }
+
+        values_num = f->base;
+        break;
+
+      case MPC_TYPE_OR:
+
+        if (ok) {
+          if (f->j < 0 && f->ek) { *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), f->ek); }
+          if (f->j >= 0 && f->j < f->k) {
+            mpc_err_delete_internal(i, f->ek);
+            mpc_err_delete_internal(i, f->kerr);
+          }
+          break;
+        }
+
+        if (f->j < 0) { f->kerr = res.error; }
+        else { *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), res.error); }
+
+        /* Fall back to trying alternatives in order, replaying the one already tried */
+        for (f->j++; f->j < in->n && f->j == f->k; f->j++) {
+          if (f->ek) { *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), f->ek); f->ek = NULL; }
+          *MPC_ACC(f) = mpc_err_merge(i, *MPC_ACC(f), f->kerr);
+          f->kerr = NULL;
+        }
+
+        if (f->j < in->n) { MPC_CALL(f->j); continue; }
+        MPC_FAILURE(NULL);
+        break;
+
+      default: break;
+    }
+
+    if (mpc_profiled(i, p)) { mpc_profile_exit(i, ok); }
+    frames_num--;
+  }
+
+  free(frames);
+  free(values);
+  m->frames_num = 0;
+  m->frames = NULL;
+  m->values = NULL;
+
+  *r = res;
+  return ok;
+}
+
+static int mpc_parse_program(mpc_input_t *i, mpc_program_t *g, mpc_result_t *r, mpc_err_t **e) {
+  mpc_machine_t m;
+  mpc_machine_init(&m, g);
+  return mpc_machine_run(i, &m, r, e);
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+#undef MPC_CALL
+#undef MPC_ACC
+
+static void mpc_parse_stats(mpc_input_t *i, mpc_parser_t *p) {
+
+  mpc_stats_t *s;
+
+  if (p->stats == NULL) { p->stats = calloc(1, sizeof(mpc_stats_t)); }
+
+  s = p->stats;
+  s->parses++;
+  s->allocs += i->stats.allocs;
+  s->pooled += i->stats.pooled;
+  s->fallbacks += i->stats.fallbacks;
+  s->chunks += i->stats.chunks;
+  s->chunk_bytes += i->stats.chunk_bytes;
+  if (i->stats.peak > s->peak) { s->peak = i->stats.peak; }
+  s->memo_lookups += i->stats.memo_lookups;
+  s->memo_hits += i->stats.memo_hits;
+  s->memo_stores += i->stats.memo_stores;
+  s->memo_evictions += i->stats.memo_evictions;
+  s->match_runs += i->stats.match_runs;
+  s->match_fallbacks += i->stats.match_fallbacks;
+}
+
+/*
+** Without positions only the offset into the input
+** is kept, so for an error the row and column are
+** counted out from the start once the parse is
+** over. Other input may be gone by then, so this
+** is only done for strings and mapped files.
+*/
+
+static void mpc_input_position(mpc_input_t *i, mpc_state_t *s) {
+  long j;
+  if (s->pos < 0) { return; }
+  s->row = 0;
+  s->col = 0;
+  for (j = 0; j < s->pos; j++) {
+    s->col++;
+    if (i->string[j] == '\n') {
+      s->col = 0;
+      s->row++;
+    }
+  }
+}
+
+static mpc_err_t *mpc_parse_begin(mpc_input_t *i) {
+  mpc_err_t *e;
+  if (i->type != MPC_INPUT_STRING) { i->mode &= ~MPC_PARSE_NO_POS; }
+  e = mpc_err_fail(i, "Unknown Error");
+  e->state = mpc_state_invalid();
+  i->far.state = mpc_state_invalid();
+  i->far.num = 0;
+  i->far.slots = 0;
+  i->far.expected = NULL;
+  return e;
+}
+
+static void mpc_parse_end(mpc_input_t *i, mpc_parser_t *p, int x, mpc_result_t *r, mpc_err_t *e) {
+  mpc_memo_delete(i);
+  if (x) {
+    mpc_err_delete_internal(i, e);
+    r->output = mpc_export(i, r->output);
+  } else {
+    e = mpc_err_merge(i, e, r->error);
+    r->error = mpc_err_export(i, mpc_err_merge(i, e, mpc_err_far_export(i)));
+    if (i->mode & MPC_PARSE_NO_POS) { mpc_input_position(i, &r->error->state); }
+  }
+  free((void*)i->far.expected);
+  if (i->mode & MPC_PARSE_STATS) { mpc_parse_stats(i, p); }
+
+  /* The finished tree takes ownership of the arena it was built in */
+  if (x && i->arena && r->output) {
+    r->output = mpc_ast_arena_own(i->arena, r->output);
+    if (((mpc_ast_t*)r->output)->arena == i->arena) { i->arena = NULL; }
+  }
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_err_t *e = mpc_parse_begin(i);
+  if (p->program && !(i->mode & MPC_PARSE_PACKRAT)) {
+    x = mpc_parse_program(i, p->program, r, &e);
+  } else {
+    x = mpc_parse_run(i, p, r, &e, 0);
+  }
+  mpc_parse_end(i, p, x, r, e);
+  return x;
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_mode(MPC_PARSE_DEFAULT, filename, string, p, r);
+}
+
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_mode(MPC_PARSE_DEFAULT, filename, string, length, p, r);
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_file_mode(MPC_PARSE_DEFAULT, filename, file, p, r);
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_pipe_mode(MPC_PARSE_DEFAULT, filename, pipe, p, r);
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_contents_mode(MPC_PARSE_DEFAULT, filename, p, r);
+}
+
+int mpc_parse_mode(int mode, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->mode = mode;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_nparse_mode(int mode, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  i->mode = mode;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_file_mode(int mode, const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  i->mode = mode;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe_mode(int mode, const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  i->mode = mode;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents_mode(int mode, const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+  FILE *f = fopen(filename, "rb");
+  int res;
+
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+
+  res = mpc_parse_file_mode(mode, filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Push Parsing
+**
+** A feed runs the compiled program of a parser
+** over input handed to it a chunk at a time. When
+** an instruction needs to see past what has come
+** so far, the program stops there with its stacks
+** as they are, and the next chunk carries on from
+** that same instruction, so nothing already read
+** is parsed again.
+*/
+
+struct mpc_feed_t {
+  mpc_input_t *i;
+  mpc_parser_t *p;
+  mpc_program_t *g;
+  mpc_machine_t m;
+  mpc_err_t *e;
+  size_t slots;
+  int done;
+};
+
+mpc_feed_t *mpc_feed_new(const char *filename, mpc_parser_t *p) {
+  return mpc_feed_new_mode(MPC_PARSE_DEFAULT, filename, p);
+}
+
+mpc_feed_t *mpc_feed_new_mode(int mode, const char *filename, mpc_parser_t *p) {
+
+  mpc_feed_t *f = malloc(sizeof(mpc_feed_t));
+
+  f->i = mpc_input_new_nstring(filename, "", 0);
+  f->i->mode = mode;
+  f->i->feeding = 1;
+  f->slots = 1;
+
+  /* A parser which was never compiled gets a program of the feed's own */
+  f->p = p;
+  f->g = p->program ? NULL : mpc_program_new(p);
+  mpc_machine_init(&f->m, p->program ? p->program : f->g);
+
+  f->e = mpc_parse_begin(f->i);
+  f->done = 0;
+  return f;
+}
+
+int mpc_parser_feed(mpc_feed_t *f, const char *chunk, size_t length, mpc_result_t *r) {
+
+  int x;
+  mpc_input_t *i = f->i;
+
+  if (f->done) {
+    r->output = NULL;
+    r->error = mpc_err_file(i->filename, "Feed already finished!");
+    return MPC_FEED_ERROR;
+  }
+
+  if (length == 0) {
+    i->feeding = 0;
+  } else {
+    if ((size_t)i->feed_len + length + 1 > f->slots) {
+      while ((size_t)i->feed_len + length + 1 > f->slots) { f->slots *= 2; }
+      i->string = realloc(i->string, f->slots);
+    }
+    memcpy(i->string + i->feed_len, chunk, length);
+    i->feed_len += (long)length;
+    i->string[i->feed_len] = '\0';
+  }
+
+  x = mpc_machine_run(i, &f->m, r, &f->e);
+  if (x < 0) { return MPC_FEED_MORE; }
+
+  f->done = 1;
+  mpc_parse_end(i, f->p, x, r, f->e);
+  f->e = NULL;
+  return x ? MPC_FEED_COMPLETE : MPC_FEED_ERROR;
+}
+
+void mpc_feed_delete(mpc_feed_t *f) {
+  if (!f->done) {
+    mpc_machine_abandon(f->i, &f->m);
+    mpc_profile_unwind(f->i);
+    mpc_err_delete_internal(f->i, f->e);
+    free((void*)f->i->far.expected);
+  }
+  mpc_program_delete(f->g);
+  mpc_input_delete(f->i);
+  free(f);
+}
+
+/*
+** Building a Parser
+*/
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  free(p->data.or.first);
+
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      free(p->data.string.x);
+      free(p->data.string.set);
+      break;
+
+    case MPC_TYPE_SET:
+      for (i = 0; i < p->data.set.n; i++) { free(p->data.set.ms[i]); }
+      free(p->data.set.ms);
+      free(p->data.set.x);
+      free(p->data.set.skip);
+      break;
+
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_SPAN:     mpc_undefine_unretained(p->data.span.x, 0);     break;
+
+    case MPC_TYPE_MATCH:
+      mpc_undefine_unretained(p->data.match.x, 0);
+      mpc_match_delete(p->data.match.m);
+      break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+
+    case MPC_TYPE_CHECK:
+      mpc_undefine_unretained(p->data.check.x, 0);
+      free(p->data.check.e);
+      break;
+
+    case MPC_TYPE_CHECK_WITH:
+      mpc_undefine_unretained(p->data.check_with.x, 0);
+      free(p->data.check_with.e);
+      break;
+
+    default: break;
+  }
+
+  if (!force) {
+    mpc_program_delete(p->program);
+    free(p->stats);
+    free(p->name);
+    free(p);
+  }
+
+}
+
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    }
+
+    mpc_program_delete(p->program);
+    free(p->stats);
+    free(p->name);
+    free(p);
+
+  } else {
+    mpc_undefine_unretained(p, 0);
+  }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
+}
+
+mpc_parser_t *mpc_copy(mpc_parser_t *a) {
+  int i = 0;
+  mpc_parser_t *p;
+
+  if (a->retained) { return a; }
+
+  p = mpc_undefined();
+  p->retained = a->retained;
+  p->type = a->type;
+  p->data = a->data;
+
+  if (a->name) {
+    p->name = malloc(strlen(a->name)+1);
+    strcpy(p->name, a->name);
+  }
+
+  switch (a->type) {
+
+    case MPC_TYPE_FAIL:
+      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
+      strcpy(p->data.fail.m, a->data.fail.m);
+    break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = malloc(strlen(a->data.string.x)+1);
+      strcpy(p->data.string.x, a->data.string.x);
+      if (a->data.string.set) {
+        p->data.string.set = malloc(32);
+        memcpy(p->data.string.set, a->data.string.set, 32);
+      }
+      break;
+
+    case MPC_TYPE_SET:
+      p->data.set.x = malloc(32);
+      memcpy(p->data.set.x, a->data.set.x, 32);
+      p->data.set.skip = malloc(256);
+      memcpy(p->data.set.skip, a->data.set.skip, 256);
+      p->data.set.ms = malloc(a->data.set.n * sizeof(char*));
+      for (i = 0; i < a->data.set.n; i++) {
+        p->data.set.ms[i] = malloc(strlen(a->data.set.ms[i])+1);
+        strcpy(p->data.set.ms[i], a->data.set.ms[i]);
+      }
+      break;
+
+    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_SPAN:     p->data.span.x     = mpc_copy(a->data.span.x);     break;
+
+    case MPC_TYPE_MATCH:
+      p->data.match.x = mpc_copy(a->data.match.x);
+      p->data.match.m = mpc_match_new(p->data.match.x);
+      break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      p->data.not.x = mpc_copy(a->data.not.x);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_copy(a->data.expect.x);
+      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
+      strcpy(p->data.expect.m, a->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
       p->data.repeat.x = mpc_copy(a->data.repeat.x);
       break;
 
-    case MPC_TYPE_OR:
-      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.or.n; i++) {
-        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
-      }
-    break;
-    case MPC_TYPE_AND:
-      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.and.n; i++) {
-        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
-      }
-      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
-      for (i = 0; i < a->data.and.n-1; i++) {
-        p->data.and.dxs[i] = a->data.and.dxs[i];
-      }
-    break;
+    case MPC_TYPE_OR:
+      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.or.n; i++) {
+        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
+      }
+      if (a->data.or.first) {
+        p->data.or.first = malloc(256);
+        memcpy(p->data.or.first, a->data.or.first, 256);
+      }
+    break;
+    case MPC_TYPE_AND:
+      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.and.n; i++) {
+        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
+      }
+      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
+      for (i = 0; i < a->data.and.n-1; i++) {
+        p->data.and.dxs[i] = a->data.and.dxs[i];
+      }
+    break;
+
+    case MPC_TYPE_CHECK:
+      p->data.check.x      = mpc_copy(a->data.check.x);
+      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
+      strcpy(p->data.check.e, a->data.check.e);
+      break;
+    case MPC_TYPE_CHECK_WITH:
+      p->data.check_with.x = mpc_copy(a->data.check_with.x);
+      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
+      strcpy(p->data.check_with.e, a->data.check_with.e);
+      break;
+
+    default: break;
+  }
+
+
+  return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  mpc_program_delete(p->program);
+  p->program = NULL;
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+
+  if (p->retained) {
+    mpc_program_delete(p->program);
+    p->program = NULL;
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+
+  free(a);
+  return p;
+}
+
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
+  va_end(va);
+
+  free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  if (!buffer) {
+    return NULL;
+  }
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  if (!buffer) {
+    return NULL;
+  }
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RANGE;
+  p->data.range.x = s;
+  p->data.range.y = e;
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.set = mpc_class_new(s, 0);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.set = mpc_class_new(s, 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "none of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
+
+mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK;
+  p->data.check.x = a;
+  p->data.check.dx = da;
+  p->data.check.f = f;
+  p->data.check.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK_WITH;
+  p->data.check_with.x = a;
+  p->data.check_with.dx = da;
+  p->data.check_with.f = f;
+  p->data.check_with.d = x;
+  p->data.check_with.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check_with.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check(a, da, f, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check_with(a, da, f, x, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }
+  va_end(va);
+
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+mpc_parser_t *mpc_soi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SOI;
+  return mpc_expect(p, "start of input");
+}
+
+mpc_parser_t *mpc_eoi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EOI;
+  return mpc_expect(p, "end of input");
+}
+
+static int mpc_boundary_anchor(char prev, char next) {
+  const char* word = "abcdefghijklmnopqrstuvwxyz"
+                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "0123456789_";
+  if ( strchr(word, next) &&  prev == '\0') { return 1; }
+  if ( strchr(word, prev) &&  next == '\0') { return 1; }
+  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  return 0;
+}
+
+static int mpc_boundary_newline_anchor(char prev, char next) {
+  (void)next;
+  return prev == '\n';
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
+mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1;
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
+    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
+    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
+    default:
+      num = *(int*)xs[1];
+      free(xs[1]);
+  }
+
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+
+  int mode = *((int*)data);
+  char *s = x;
+  mpc_parser_t *p;
+
+  /* Any Character */
+  if (s[0] == '.') {
+    free(s);
+    if (mode & MPC_RE_DOTALL) {
+      return mpc_any();
+    } else {
+      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+    }
+  }
+
+  /* Start of Input */
+  if (s[0] == '^') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
+    } else {
+      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    }
+  }
+
+  /* End of Input */
+  if (s[0] == '$') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_or(2,
+        mpc_newline(),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    } else {
+      return mpc_or(2,
+        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    }
+  }
+
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  for (i = comp; i < strlen(s); i++){
+
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];
+      }
+      i++;
+    }
+
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }
+      }
+    }
+
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  return mpc_re_mode(re, MPC_RE_DEFAULT);
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+
+  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
+    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+  ));
+
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+  mpc_optimise(RegexEnclose);
+  mpc_optimise(Regex);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  mpc_optimise(Range);
+
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+
+  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+
+  mpc_optimise(r.output);
+
+  return r.output;
+
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 10);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 16);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 8);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+  float *y = malloc(sizeof(float));
+  *y = strtod(x, NULL);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
+  char *s = x;
+  while (isspace((unsigned char)*s)) {
+    memmove(s, s+1, strlen(s));
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
+  char *s = x;
+  size_t l = strlen(s);
+  while (l > 0 && isspace((unsigned char)s[l-1])) {
+    s[l-1] = '\0'; l--;
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
+  return mpcf_strtriml(mpcf_strtrimr(x));
+}
+
+static const char mpc_escape_input_c[]  = {
+  '\a', '\b', '\f', '\n', '\r',
+  '\t', '\v', '\\', '\'', '\"', '\0'};
+
+static const char *mpc_escape_output_c[] = {
+  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
+  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static const char mpc_escape_input_raw_re[] = { '/' };
+static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static const char mpc_escape_input_raw_cstr[] = { '"' };
+static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static const char mpc_escape_input_raw_cchar[] = { '\'' };
+static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  int found;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+
+  while (*s) {
+
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if (*s == input[i]) {
+        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        strcat(y, output[i]);
+        found = 1;
+        break;
+      }
+      i++;
+    }
+
+    if (!found) {
+      y = realloc(y, strlen(y) + 2);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+
+    s++;
+  }
+
+
+  return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  int found = 0;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+
+  while (*s) {
+
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if ((*(s+0)) == output[i][0] &&
+          (*(s+1)) == output[i][1]) {
+        y = realloc(y, strlen(y) + 1 + 1);
+        buff[0] = input[i]; buff[1] = '\0';
+        strcat(y, buff);
+        found = 1;
+        s++;
+        break;
+      }
+      i++;
+    }
+
+    if (!found) {
+      y = realloc(y, strlen(y) + 1 + 1);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+
+    if (*s == '\0') { break; }
+    else { s++; }
+  }
+
+  return y;
+
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i != x) { free(xs[i]); }
+  }
+  return xs[x];
+}
+
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
+  int i;
+  for (i = 0; i < n; i++) {
+    free(xs[i]);
+  }
+  return NULL;
+}
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+  int i;
+  size_t k, l = 0;
+
+  if (n == 0) { return calloc(1, 1); }
+
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+
+  k = strlen(xs[0]);
+  xs[0] = realloc(xs[0], l + 1);
+
+  for (i = 1; i < n; i++) {
+    l = strlen(xs[i]);
+    memcpy((char*)xs[0] + k, xs[i], l);
+    k += l;
+    free(xs[i]);
+  }
+
+  ((char*)xs[0])[k] = '\0';
+  return xs[0];
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+
+  /* TODO: Print Everything Escaped */
+
+  int i, j;
+  char *s, *e;
+  char buff[2];
+  char members[256];
+
+  if (p->retained && !force) {;
+    if (p->name) { printf("<%s>", p->name); }
+    else { printf("<anon>"); }
+    return;
+  }
+
+  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+  if (p->type == MPC_TYPE_EXPECT) {
+    printf("%s", p->data.expect.m);
+    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  }
+
+  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+  if (p->type == MPC_TYPE_SINGLE) {
+    buff[0] = p->data.single.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("'%s'", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_RANGE) {
+    buff[0] = p->data.range.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    buff[0] = p->data.range.y; buff[1] = '\0';
+    e = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s-%s]", s, e);
+    free(s);
+    free(e);
+  }
+
+  if (p->type == MPC_TYPE_ONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_NONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[^%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_SET) {
+    for (i = 1, j = 0; i < 256; i++) {
+      if (MPC_CLASS_HAS(p->data.set.x, i)) { members[j++] = (char)i; }
+    }
+    members[j] = '\0';
+    s = mpcf_escape_new(
+      members,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_STRING) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("\"%s\"", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MATCH)    { mpc_print_unretained(p->data.match.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+
+  if (p->type == MPC_TYPE_OR) {
+    printf("(");
+    for(i = 0; i < p->data.or.n-1; i++) {
+      mpc_print_unretained(p->data.or.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_AND) {
+    printf("(");
+    for(i = 0; i < p->data.and.n-1; i++) {
+      mpc_print_unretained(p->data.and.xs[i], 0);
+      printf(" ");
+    }
+    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_CHECK) {
+    mpc_print_unretained(p->data.check.x, 0);
+    printf("->?");
+  }
+  if (p->type == MPC_TYPE_CHECK_WITH) {
+    mpc_print_unretained(p->data.check_with.x, 0);
+    printf("->?");
+  }
+
+}
+
+void mpc_print(mpc_parser_t *p) {
+  mpc_print_unretained(p, 1);
+  printf("\n");
+}
+
+/*
+** Testing
+*/
+
+/*
+** These functions are slightly unwieldy and
+** also the whole of the testing suite for mpc
+** mpc is pretty shaky.
+**
+** It could do with a lot more tests and more
+** precision. Currently I am only really testing
+** changes off of the examples.
+**
+*/
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+  mpc_result_t r;
+  (void) printer;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 0;
+    } else {
+      destructor(r.output);
+      return 1;
+    }
+
+  } else {
+    mpc_err_delete(r.error);
+    return 1;
+  }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+
+  }
+
+}
+
+
+/*
+** AST
+*/
+
+/*
+** An arena allocates nodes, their contents and
+** their children arrays by bumping a pointer
+** through blocks that double in size. Tags are
+** interned so each distinct tag is stored once,
+** and the tags made by combining two others are
+** cached by the pointers combined, which in a
+** parse repeat for every node of the same rule.
+** A caller may reuse the memory behind a pointer
+** for a different tag, so a hit still compares
+** the cached tag against the pieces given.
+*/
+
+enum {
+  MPC_AST_ARENA_BLOCK_MIN = 4096,
+  MPC_AST_ARENA_ALIGN     = 8,
+  MPC_AST_ARENA_TAGS_MIN  = 32,
+  MPC_AST_ARENA_CACHE     = 64
+};
 
-    case MPC_TYPE_CHECK:
-      p->data.check.x      = mpc_copy(a->data.check.x);
-      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
-      strcpy(p->data.check.e, a->data.check.e);
-      break;
-    case MPC_TYPE_CHECK_WITH:
-      p->data.check_with.x = mpc_copy(a->data.check_with.x);
-      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
-      strcpy(p->data.check_with.e, a->data.check_with.e);
-      break;
+enum {
+  MPC_AST_ARENA_TAG      = 0,
+  MPC_AST_ARENA_ADD_TAG  = 1,
+  MPC_AST_ARENA_ROOT_TAG = 2
+};
 
-    default: break;
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t size;
+} mpc_ast_block_t;
+
+typedef struct {
+  const char *t;
+  const char *old;
+  int kind;
+  char *tag;
+} mpc_ast_tag_cache_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_t *root;
+  mpc_ast_block_t *blocks;
+  char *next;
+  char *end;
+  int tags_num;
+  int tags_slots;
+  char **tags;
+  int foreign;
+  mpc_ast_tag_cache_t cache[MPC_AST_ARENA_CACHE];
+};
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *a = calloc(1, sizeof(mpc_ast_arena_t));
+  a->tags_slots = MPC_AST_ARENA_TAGS_MIN;
+  a->tags = calloc(a->tags_slots, sizeof(char*));
+  return a;
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  mpc_ast_block_t *b, *n;
+  if (a == NULL) { return; }
+  for (b = a->blocks; b; b = n) { n = b->next; free(b); }
+  free(a->tags);
+  free(a);
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a);
+
+static int mpc_ast_arena_other(mpc_ast_t *n, void *a) {
+  return n->arena != a;
+}
+
+/*
+** A tree whose root came from elsewhere, such as an
+** apply building it on the heap, may still hold nodes
+** of the arena. The root is then moved into the arena
+** so the arena can belong to it, leaving any other
+** nodes as children from outside the arena.
+*/
+
+static mpc_ast_t *mpc_ast_arena_own(mpc_ast_arena_t *a, mpc_ast_t *root) {
+
+  mpc_ast_t *r;
+  int i;
+
+  if (root->arena == NULL && !mpc_ast_visit(root, mpc_ast_trav_order_pre, mpc_ast_arena_other, a)) {
+    r = mpc_ast_arena_node(a, root->tag, root->contents, strlen(root->contents));
+    r->state = root->state;
+    for (i = 0; i < root->children_num; i++) {
+      mpc_ast_add_child(r, root->children[i]);
+    }
+    mpc_ast_delete_no_children(root);
+    root = r;
   }
 
+  if (root->arena == a) { a->root = root; }
+  return root;
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *a, size_t n) {
 
+  char *p;
+  mpc_ast_block_t *b;
+  size_t size, head;
+
+  /* Round sizes and the block header up so allocations stay aligned */
+  n = (n + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
+  head = (sizeof(mpc_ast_block_t) + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
+
+  if (a->next == NULL || (size_t)(a->end - a->next) < n) {
+    size = a->blocks ? a->blocks->size * 2 : MPC_AST_ARENA_BLOCK_MIN;
+    while (size < head + n) { size = size * 2; }
+    b = malloc(size);
+    b->next = a->blocks;
+    b->size = size;
+    a->blocks = b;
+    a->next = (char*)b + head;
+    a->end = (char*)b + size;
+  }
+
+  p = a->next;
+  a->next += n;
   return p;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
+/* Intern the concatenation of up to three pieces of string */
+static char *mpc_ast_arena_intern(mpc_ast_arena_t *a,
+  const char *s0, size_t n0, const char *s1, size_t n1, const char *s2, size_t n2) {
+
+  int j, k;
+  char *t, **tags;
+  unsigned long h = 2166136261UL;
+
+  h = mpc_fnv1a(s0, n0, h);
+  h = mpc_fnv1a(s1, n1, h);
+  h = mpc_fnv1a(s2, n2, h);
+
+  for (j = (int)(h & (a->tags_slots-1)); a->tags[j]; j = (j+1) & (a->tags_slots-1)) {
+    t = a->tags[j];
+    if (strncmp(t, s0, n0) == 0
+    &&  strncmp(t + n0, s1, n1) == 0
+    &&  strncmp(t + n0 + n1, s2, n2) == 0
+    &&  t[n0 + n1 + n2] == '\0') { return t; }
+  }
+
+  t = mpc_ast_arena_alloc(a, n0 + n1 + n2 + 1);
+  memcpy(t, s0, n0);
+  memcpy(t + n0, s1, n1);
+  memcpy(t + n0 + n1, s2, n2);
+  t[n0 + n1 + n2] = '\0';
+  a->tags[j] = t;
+  a->tags_num++;
+
+  /* Keep the table at most half full */
+  if (a->tags_num * 2 > a->tags_slots) {
+    tags = a->tags;
+    a->tags_slots = a->tags_slots * 2;
+    a->tags = calloc(a->tags_slots, sizeof(char*));
+    for (k = 0; k < a->tags_slots / 2; k++) {
+      if (tags[k] == NULL) { continue; }
+      h = mpc_fnv1a(tags[k], strlen(tags[k]), 2166136261UL);
+      for (j = (int)(h & (a->tags_slots-1)); a->tags[j]; j = (j+1) & (a->tags_slots-1));
+      a->tags[j] = tags[k];
+    }
+    free(tags);
+  }
+
+  return t;
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+static int mpc_ast_arena_tag_is(const char *tag, const char *t, const char *old, int kind) {
+  size_t n = strlen(t);
+  switch (kind) {
+    case MPC_AST_ARENA_ADD_TAG:
+      return strncmp(tag, t, n) == 0 && tag[n] == '|' && strcmp(tag + n + 1, old) == 0;
+    case MPC_AST_ARENA_ROOT_TAG:
+      return strncmp(tag, t, n-1) == 0 && strcmp(tag + n - 1, old) == 0;
+    default:
+      return strcmp(tag, t) == 0;
+  }
+}
 
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+static char *mpc_ast_arena_tag(mpc_ast_arena_t *a, const char *t, const char *old, int kind) {
+
+  char *tag;
+  mpc_ast_tag_cache_t *c;
+  unsigned long h = ((unsigned long)(size_t)t >> 3) * 31 + ((unsigned long)(size_t)old >> 3) + kind;
+
+  c = &a->cache[h % MPC_AST_ARENA_CACHE];
+  if (c->tag && c->t == t && c->old == old && c->kind == kind
+  &&  mpc_ast_arena_tag_is(c->tag, t, old, kind)) { return c->tag; }
+
+  switch (kind) {
+    case MPC_AST_ARENA_ADD_TAG:
+      tag = mpc_ast_arena_intern(a, t, strlen(t), "|", 1, old, strlen(old));
+      break;
+    case MPC_AST_ARENA_ROOT_TAG:
+      tag = mpc_ast_arena_intern(a, t, strlen(t)-1, old, strlen(old), "", 0);
+      break;
+    default:
+      tag = mpc_ast_arena_intern(a, t, strlen(t), "", 0, "", 0);
+      break;
   }
 
-  free(a);
-  return p;
+  c->t = t;
+  c->old = old;
+  c->kind = kind;
+  c->tag = tag;
+  return tag;
 }
 
-void mpc_cleanup(int n, ...) {
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *a, const char *tag, const char *contents, size_t length) {
+
+  mpc_ast_t *n = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t));
+
+  n->tag = mpc_ast_arena_tag(a, tag, NULL, MPC_AST_ARENA_TAG);
+  n->contents = mpc_ast_arena_alloc(a, length + 1);
+  memcpy(n->contents, contents, length);
+  n->contents[length] = '\0';
+
+  n->state = mpc_state_new();
+  n->children_num = 0;
+  n->children = NULL;
+  n->arena = a;
+  return n;
+}
+
+/*
+** Deletion is iterative so that deep trees cannot
+** overflow the C stack. Children waiting to be freed
+** are kept in a small local array, which only moves to
+** the heap for trees too wide or deep to fit in it. A
+** tree built in an arena is released in one go, unless
+** nodes from elsewhere were added to it. Then it is
+** walked first, freeing those as any child is freed,
+** and the arena goes once the walk is back at its root.
+*/
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+  mpc_ast_t *local[64];
+  mpc_ast_t **stack = local;
+  int stack_num = 0;
+  int stack_slots = 64;
   int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
 
+  if (a == NULL) { return; }
+
+  stack[stack_num++] = a;
+
+  while (stack_num > 0) {
+
+    a = stack[--stack_num];
+
+    /* An arena holding foreign nodes has its root seen twice, walking then freeing */
+    if (a->arena) {
+      if (a->arena->root == a && a->arena->foreign == 1) {
+        a->arena->foreign = 2;
+        stack[stack_num++] = a;
+      } else if (a->arena->root == a) {
+        mpc_ast_arena_delete(a->arena);
+        continue;
+      } else if (a->arena->foreign != 2) {
+        continue;
+      }
+    }
+
+    if (stack_num + a->children_num > stack_slots) {
+      stack_slots = (stack_num + a->children_num) * 2;
+      if (stack == local) {
+        stack = malloc(sizeof(mpc_ast_t*) * stack_slots);
+        memcpy(stack, local, sizeof(mpc_ast_t*) * stack_num);
+      } else {
+        stack = realloc(stack, sizeof(mpc_ast_t*) * stack_slots);
+      }
+    }
+
+    for (i = a->children_num-1; i >= 0; i--) {
+      stack[stack_num++] = a->children[i];
+    }
+
+    if (a->arena) { continue; }
+
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+  }
+
+  if (stack != local) { free(stack); }
+
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
+  free(a->children);
+  free(a->tag);
+  free(a->contents);
+  free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+  a->tag = malloc(strlen(tag) + 1);
+  strcpy(a->tag, tag);
+
+  a->contents = malloc(strlen(contents) + 1);
+  strcpy(a->contents, contents);
+
+  a->state = mpc_state_new();
+
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = NULL;
+  return a;
+
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+
+  mpc_ast_t *a = mpc_ast_new(tag, "");
+
+  int i;
   va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
+  va_start(va, tag);
+
+  for (i = 0; i < n; i++) {
+    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+  }
+
   va_end(va);
 
-  free(list);
+  return a;
+
 }
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+  if (a->children_num == 0) { return a; }
+  if (a->children_num == 1) { return a; }
+
+  r = a->arena ? mpc_ast_arena_node(a->arena, ">", "", 0) : mpc_ast_new(">", "");
+  mpc_ast_add_child(r, a);
+  return r;
 }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+
+  int i;
+
+  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (a->children_num != b->children_num) { return 0; }
+
+  for (i = 0; i < a->children_num; i++) {
+    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  }
+
+  return 1;
 }
 
-/*
-** As `snprintf` is not ANSI standard this
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+
+  mpc_ast_t **children;
+  int n = r->children_num;
+
+  /* Arena children arrays double each time they fill a power of two */
+  if (r->arena) {
+    if (n == 0 || (n >= 4 && (n & (n-1)) == 0)) {
+      children = mpc_ast_arena_alloc(r->arena, sizeof(mpc_ast_t*) * (n ? n * 2 : 4));
+      if (n) { memcpy(children, r->children, sizeof(mpc_ast_t*) * n); }
+      r->children = children;
+    }
+    if (a && a->arena != r->arena) { r->arena->foreign = 1; }
+    r->children[r->children_num++] = a;
+    return r;
+  }
+
+  r->children_num++;
+  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  r->children[r->children_num-1] = a;
+  return r;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  if (a->arena) {
+    a->tag = mpc_ast_arena_tag(a->arena, t, a->tag, MPC_AST_ARENA_ADD_TAG);
+    return a;
+  }
+  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
+  memmove(a->tag, t, strlen(t));
+  memmove(a->tag + strlen(t), "|", 1);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  if (a->arena) {
+    a->tag = mpc_ast_arena_tag(a->arena, t, a->tag, MPC_AST_ARENA_ROOT_TAG);
+    return a;
+  }
+  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
+  memmove(a->tag, t, (strlen(t)-1));
+  return a;
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) {
+    a->tag = mpc_ast_arena_tag(a->arena, t, NULL, MPC_AST_ARENA_TAG);
+    return a;
+  }
+  a->tag = realloc(a->tag, strlen(t) + 1);
+  strcpy(a->tag, t);
+  return a;
+}
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+  if (a == NULL) { return a; }
+  a->state = s;
+  return a;
+}
 
-  va_list va;
-  char *buffer;
+static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
+  int i;
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  if (!buffer) {
-    return NULL;
+  if (a == NULL) {
+    fprintf(fp, "NULL\n");
+    return;
   }
-  vsprintf(buffer, fmt, va);
-  va_end(va);
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
+  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
-}
+  if (strlen(a->contents)) {
+    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+      (long unsigned int)(a->state.row+1),
+      (long unsigned int)(a->state.col+1),
+      a->contents);
+  } else {
+    fprintf(fp, "%s \n", a->tag);
+  }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
-}
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_print_depth(a->children[i], d+1, fp);
+  }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
+void mpc_ast_print(mpc_ast_t *a) {
+  mpc_ast_print_depth(a, 0, stdout);
 }
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+  mpc_ast_print_depth(a, 0, fp);
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_index_lb(ast, tag, 0);
 }
 
-/*
-** As `snprintf` is not ANSI standard this
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
-
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
+int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int i;
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  if (!buffer) {
-    return NULL;
+  for(i=lb; i<ast->children_num; i++) {
+    if(strcmp(ast->children[i]->tag, tag) == 0) {
+      return i;
+    }
   }
-  vsprintf(buffer, fmt, va);
-  va_end(va);
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+  return -1;
 }
 
-/*
-** Basic Parsers
-*/
-
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
+mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_child_lb(ast, tag, 0);
 }
 
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
-}
+mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int i;
 
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
-}
+  for(i=lb; i<ast->children_num; i++) {
+    if(strcmp(ast->children[i]->tag, tag) == 0) {
+      return ast->children[i];
+    }
+  }
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+  return NULL;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
+mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
+                                       mpc_ast_trav_order_t order)
+{
+  mpc_ast_trav_t *trav, *n_trav;
+  mpc_ast_t *cnode = ast;
 
-}
+  /* Create the traversal structure */
+  trav = malloc(sizeof(mpc_ast_trav_t));
+  trav->curr_node = cnode;
+  trav->parent = NULL;
+  trav->curr_child = 0;
+  trav->order = order;
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
-}
+  /* Get start node */
+  switch(order) {
+    case mpc_ast_trav_order_pre:
+      /* Nothing else is needed for pre order start */
+      break;
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
-}
+    case mpc_ast_trav_order_post:
+      while(cnode->children_num > 0) {
+        cnode = cnode->children[0];
 
-/*
-** Core Parsers
-*/
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
+        n_trav->curr_node = cnode;
+        n_trav->parent = trav;
+        n_trav->curr_child = 0;
+        n_trav->order = order;
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
-}
+        trav = n_trav;
+      }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
-}
+      break;
 
-mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK;
-  p->data.check.x = a;
-  p->data.check.dx = da;
-  p->data.check.f = f;
-  p->data.check.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check.e, e);
-  return p;
-}
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
 
-mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK_WITH;
-  p->data.check_with.x = a;
-  p->data.check_with.dx = da;
-  p->data.check_with.f = f;
-  p->data.check_with.d = x;
-  p->data.check_with.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check_with.e, e);
-  return p;
+  return trav;
 }
 
-mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav, *to_free;
+  mpc_ast_t *ret = NULL;
+  int cchild;
+
+  /* The end of traversal was reached */
+  if(*trav == NULL) return NULL;
+
+  switch((*trav)->order) {
+    case mpc_ast_trav_order_pre:
+      ret = (*trav)->curr_node;
+
+      /* If there aren't any more children, go up */
+      while(*trav != NULL &&
+        (*trav)->curr_child >= (*trav)->curr_node->children_num)
+      {
+        to_free = *trav;
+        *trav = (*trav)->parent;
+        free(to_free);
+      }
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+      /* If trav is NULL, the end was reached */
+      if(*trav == NULL) {
+        break;
+      }
 
-  p = mpc_check(a, da, f, buffer);
-  free(buffer);
+      /* Go to next child */
+      n_trav = malloc(sizeof(mpc_ast_trav_t));
 
-  return p;
-}
+      cchild = (*trav)->curr_child;
+      n_trav->curr_node = (*trav)->curr_node->children[cchild];
+      n_trav->parent = *trav;
+      n_trav->curr_child = 0;
+      n_trav->order = (*trav)->order;
 
-mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+      (*trav)->curr_child++;
+      *trav = n_trav;
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+      break;
 
-  p = mpc_check_with(a, da, f, x, buffer);
-  free(buffer);
+    case mpc_ast_trav_order_post:
+      ret = (*trav)->curr_node;
 
-  return p;
-}
+      /* Move up tree to the parent If the parent doesn't have any more nodes,
+       * then this is the current node. If it does, move down to its left most
+       * child. Also, free the previous traversal node */
+      to_free = *trav;
+      *trav = (*trav)->parent;
+      free(to_free);
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
-}
+      if(*trav == NULL)
+        break;
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
-}
+      /* Next child */
+      (*trav)->curr_child++;
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
-}
+      /* If there aren't any more children, this is the next node */
+      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
+        break;
+      }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
-}
+      /* If there are still more children, find the leftmost child from this
+       * node */
+      while((*trav)->curr_node->children_num > 0) {
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
-}
+        cchild = (*trav)->curr_child;
+        n_trav->curr_node = (*trav)->curr_node->children[cchild];
+        n_trav->parent = *trav;
+        n_trav->curr_child = 0;
+        n_trav->order = (*trav)->order;
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+        *trav = n_trav;
+      }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
-  return p;
+  return ret;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
+void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav;
 
-  int i;
-  va_list va;
+  /* Go through parents until all are free */
+  while(*trav != NULL) {
+      n_trav = (*trav)->parent;
+      free(*trav);
+      *trav = n_trav;
+  }
+}
 
-  mpc_parser_t *p = mpc_undefined();
+/*
+** Unlike the traversal above the iterator keeps its
+** path in one array of frames, which is reused across
+** calls to `mpc_ast_iter_start`. A frame's child index
+** is -1 until the node itself has been reached.
+*/
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+void mpc_ast_iter_init(mpc_ast_iter_t *it) {
+  it->order = mpc_ast_trav_order_pre;
+  it->frames_num = 0;
+  it->frames_slots = 0;
+  it->frames = NULL;
+}
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a) {
+  if (it->frames_num == it->frames_slots) {
+    it->frames_slots = it->frames_slots ? it->frames_slots * 2 : 32;
+    it->frames = realloc(it->frames, sizeof(mpc_ast_iter_frame_t) * it->frames_slots);
   }
-  va_end(va);
+  it->frames[it->frames_num].node = a;
+  it->frames[it->frames_num].child = -1;
+  it->frames_num++;
+}
 
-  return p;
+void mpc_ast_iter_start(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order) {
+  it->order = order;
+  it->frames_num = 0;
+  if (ast) { mpc_ast_iter_push(it, ast); }
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it) {
 
-  int i;
-  va_list va;
+  mpc_ast_iter_frame_t *f;
+  mpc_ast_t *c;
 
-  mpc_parser_t *p = mpc_undefined();
+  while (it->frames_num > 0) {
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+    f = &it->frames[it->frames_num-1];
 
-  va_start(va, f);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }
-  va_end(va);
+    if (f->child < 0) {
+      f->child = 0;
+      if (it->order == mpc_ast_trav_order_pre) { return f->node; }
+    }
 
-  return p;
-}
+    if (f->child < f->node->children_num) {
+      c = f->node->children[f->child++];
+      mpc_ast_iter_push(it, c);
+      continue;
+    }
 
-/*
-** Common Parsers
-*/
+    it->frames_num--;
+    if (it->order == mpc_ast_trav_order_post) { return f->node; }
+  }
 
-mpc_parser_t *mpc_soi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SOI;
-  return mpc_expect(p, "start of input");
+  return NULL;
 }
 
-mpc_parser_t *mpc_eoi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EOI;
-  return mpc_expect(p, "end of input");
+void mpc_ast_iter_free(mpc_ast_iter_t *it) {
+  free(it->frames);
+  mpc_ast_iter_init(it);
 }
 
-static int mpc_boundary_anchor(char prev, char next) {
-  const char* word = "abcdefghijklmnopqrstuvwxyz"
-                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                     "0123456789_";
-  if ( strchr(word, next) &&  prev == '\0') { return 1; }
-  if ( strchr(word, prev) &&  next == '\0') { return 1; }
-  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-  return 0;
-}
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order,
+                  int (*f)(mpc_ast_t*, void*), void *data) {
 
-static int mpc_boundary_newline_anchor(char prev, char next) {
-  (void)next;
-  return prev == '\n';
-}
+  mpc_ast_iter_t it;
+  mpc_ast_t *a;
+  int r = 1;
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
-mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+  mpc_ast_iter_init(&it);
+  mpc_ast_iter_start(&it, ast, order);
+  while ((a = mpc_ast_iter_next(&it))) {
+    if (!f(a, data)) { r = 0; break; }
+  }
+  mpc_ast_iter_free(&it);
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+  return r;
+}
 
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+  int i, j;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  mpc_ast_arena_t *arena = NULL;
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+  for (i = 0; i < n; i++) {
+    if (as[i] && as[i]->arena) { arena = as[i]->arena; break; }
+  }
 
-mpc_parser_t *mpc_real(void) {
+  r = arena ? mpc_ast_arena_node(arena, ">", "", 0) : mpc_ast_new(">", "");
 
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+  for (i = 0; i < n; i++) {
 
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+    if (as[i] == NULL) { continue; }
 
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+    if        (as[i] && as[i]->children_num == 0) {
+      mpc_ast_add_child(r, as[i]);
+    } else if (as[i] && as[i]->children_num == 1) {
+      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_delete_no_children(as[i]);
+    } else if (as[i] && as[i]->children_num >= 2) {
+      for (j = 0; j < as[i]->children_num; j++) {
+        mpc_ast_add_child(r, as[i]->children[j]);
+      }
+      mpc_ast_delete_no_children(as[i]);
+    }
 
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
 
+  return r;
 }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  free(c);
+  return a;
 }
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  (void)n;
+  a = mpc_ast_state(a, *s);
+  free(s);
+  return a;
 }
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
 
-mpc_parser_t *mpc_regex_lit(void) {
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
 }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1;
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
 }
 
-/*
-** Useful Parsers
-*/
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
 
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+mpc_parser_t *mpca_or(int n, ...) {
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  return p;
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+mpc_parser_t *mpca_and(int n, ...) {
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = mpcf_fold_ast;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  }
+  va_end(va);
+
+  return p;
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
-** Regular Expression Parsers
+** Grammar Parser
 */
 
 /*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
+** This is another interesting bootstrapping.
 **
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
 **
-** This is certainly something that
-** would be less elegant/interesting
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
 **
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
 */
 
 /*
 **
-**  ### Regular Expression Grammar
+**  ### Grammar Grammar
 **
-**      <regex> : <term> | (<term> "|" <regex>)
+**      <grammar> : (<term> "|" <grammar>) | <term>
 **
 **      <term> : <factor>*
 **
@@ -2164,1893 +6036,2184 @@ mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_
 **               | <base> "?"
 **               | <base> "{" <digits> "}"
 **
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit> <regex_mode>
+**             | "(" <grammar> ")"
 */
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+typedef struct {
+  va_list *va;
+  int parsers_num;
+  int parsers_slots;
+  mpc_parser_t **parsers;
+  int names_slots;
+  mpc_parser_t **names;
+  int flags;
+} mpca_grammar_st_t;
+
+static void mpca_grammar_st_init(mpca_grammar_st_t *st, va_list *va, int flags) {
+  st->va = va;
+  st->parsers_num = 0;
+  st->parsers_slots = 0;
+  st->parsers = NULL;
+  st->names_slots = 0;
+  st->names = NULL;
+  st->flags = flags;
+}
+
+static void mpca_grammar_st_delete(mpca_grammar_st_t *st) {
+  free(st->parsers);
+  free(st->names);
+}
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
   (void) n;
   if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
+  else { return mpca_or(2, xs[0], xs[1]); }
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
   int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  mpc_parser_t *p = mpc_pass();
   for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
   }
   return p;
 }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
   int num;
   (void) n;
   if (xs[1] == NULL) { return xs[0]; }
   switch(((char*)xs[1])[0])
   {
-    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
-    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
-    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
+    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
+    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
+    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
+    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
     default:
-      num = *(int*)xs[1];
+      num = *((int*)xs[1]);
       free(xs[1]);
   }
+  return mpca_count(num, xs[0]);
+}
 
-  return mpc_count(num, mpcf_strfold, xs[0], free);
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
-  }
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
+  char *y = xs[0];
+  char *m = xs[1];
+  mpca_grammar_st_t *st = xs[2];
+  mpc_parser_t *p;
+  int mode = MPC_RE_DEFAULT;
+
+  (void)n;
+  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
+  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  y = mpcf_unescape_regex(y);
+  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
+  free(y);
+  free(m);
+
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+  size_t i;
+  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+  return 1;
+}
+
+/*
+** Parsers are taken from the arguments only as
+** rules come to need them, and every named one is
+** kept in a hash table so looking a rule up costs
+** the same however many the grammar has.
+*/
+
+static int mpca_grammar_slot(mpca_grammar_st_t *st, const char *name) {
+  int k = (int)(mpc_fnv1a(name, strlen(name), 2166136261UL) & (unsigned long)(st->names_slots - 1));
+  while (st->names[k] && strcmp(st->names[k]->name, name) != 0) { k = (k + 1) & (st->names_slots - 1); }
+  return k;
+}
 
-  int mode = *((int*)data);
-  char *s = x;
-  mpc_parser_t *p;
+static mpc_parser_t *mpca_grammar_pull(mpca_grammar_st_t *st) {
 
-  /* Any Character */
-  if (s[0] == '.') {
-    free(s);
-    if (mode & MPC_RE_DOTALL) {
-      return mpc_any();
-    } else {
-      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
-    }
-  }
+  int j, k, slots;
+  mpc_parser_t **names;
+  mpc_parser_t *p = va_arg(*st->va, mpc_parser_t*);
 
-  /* Start of Input */
-  if (s[0] == '^') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
-    } else {
-      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    }
+  if (st->parsers_num == st->parsers_slots) {
+    st->parsers_slots = st->parsers_slots ? st->parsers_slots * 2 : 16;
+    st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_slots);
   }
-
-  /* End of Input */
-  if (s[0] == '$') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_or(2,
-        mpc_newline(),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    } else {
-      return mpc_or(2,
-        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+  st->parsers[st->parsers_num++] = p;
+
+  if (p == NULL || p->name == NULL) { return p; }
+
+  /* Keep the table at most half full */
+  if (st->parsers_num * 2 > st->names_slots) {
+    names = st->names;
+    slots = st->names_slots;
+    st->names_slots = slots ? slots * 2 : 32;
+    st->names = calloc(st->names_slots, sizeof(mpc_parser_t*));
+    for (j = 0; j < slots; j++) {
+      if (names[j]) { st->names[mpca_grammar_slot(st, names[j]->name)] = names[j]; }
     }
+    free(names);
   }
 
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
-  }
+  /* The first parser given a name is the one it refers to */
+  k = mpca_grammar_slot(st, p->name);
+  if (st->names[k] == NULL) { st->names[k] = p; }
 
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
   return p;
 }
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
-  }
-}
-
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
 
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  int i;
+  mpc_parser_t *p;
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  /* Case of Number */
+  if (is_number(x)) {
 
-  for (i = comp; i < strlen(s); i++){
+    i = strtol(x, NULL, 10);
 
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];
+    while (st->parsers_num <= i) {
+      if (mpca_grammar_pull(st) == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
-      i++;
     }
 
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }
-      }
+    return st->parsers[st->parsers_num-1];
+
+  /* Case of Identifier */
+  } else {
+
+    /* Search Existing Parsers */
+    if (st->names_slots > 0) {
+      p = st->names[mpca_grammar_slot(st, x)];
+      if (p) { return p; }
+    }
+    if (st->parsers_num > 0 && st->parsers[st->parsers_num-1] == NULL) {
+      return mpc_failf("Unknown Parser '%s'!", x);
     }
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    /* Search New Parsers */
+    while (1) {
+      p = mpca_grammar_pull(st);
+      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (strcmp(p->name, x) == 0) { return p; }
     }
 
   }
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+}
 
-  free(x);
-  free(range);
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
 
-  return out;
-}
+  mpca_grammar_st_t *st = s;
+  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  free(x);
 
-mpc_parser_t *mpc_re(const char *re) {
-  return mpc_re_mode(re, MPC_RE_DEFAULT);
+  if (p->name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  } else {
+    return mpca_state(mpca_root(p));
+  }
 }
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
 
   char *err_msg;
   mpc_parser_t *err_out;
   mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
 
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
+  GrammarTotal = mpc_new("grammar_total");
+  Grammar = mpc_new("grammar");
+  Term = mpc_new("term");
   Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+  Base = mpc_new("base");
 
-  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+  mpc_define(GrammarTotal,
+    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+  );
+
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
     Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+    mpc_soft_delete
   ));
 
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
 
-  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
     Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
-  ));
-
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
   ));
 
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
 
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
-
-  mpc_optimise(RegexEnclose);
-  mpc_optimise(Regex);
-  mpc_optimise(Term);
+  mpc_optimise(GrammarTotal);
+  mpc_optimise(Grammar);
   mpc_optimise(Factor);
+  mpc_optimise(Term);
   mpc_optimise(Base);
-  mpc_optimise(Range);
 
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
     err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
     mpc_err_delete(r.error);
     free(err_msg);
     r.output = err_out;
   }
 
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
 
 }
 
-/*
-** Common Fold Functions
-*/
-
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
 
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+  mpca_grammar_st_init(&st, &va, flags);
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 10);
-  free(x);
-  return y;
+  res = mpca_grammar_st(grammar, &st);
+  mpca_grammar_st_delete(&st);
+  va_end(va);
+  return res;
 }
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 16);
-  free(x);
-  return y;
-}
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 8);
-  free(x);
-  return y;
-}
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float *y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
-  free(x);
-  return y;
+  return stmt;
 }
 
-mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
-  char *s = x;
-  while (isspace((unsigned char)*s)) {
-    memmove(s, s+1, strlen(s));
-  }
-  return s;
-}
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
 
-mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
-  char *s = x;
-  size_t l = strlen(s);
-  while (l > 0 && isspace((unsigned char)s[l-1])) {
-    s[l-1] = '\0'; l--;
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
   }
-  return s;
-}
+  stmts[n] = NULL;
 
-mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
-  return mpcf_strtriml(mpcf_strtrimr(x));
+  return stmts;
 }
 
-static const char mpc_escape_input_c[]  = {
-  '\a', '\b', '\f', '\n', '\r',
-  '\t', '\v', '\\', '\'', '\"', '\0'};
+static void mpca_stmt_list_delete(mpc_val_t *x) {
 
-static const char *mpc_escape_output_c[] = {
-  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
-  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+  mpca_stmt_t **stmts = x;
 
-static const char mpc_escape_input_raw_re[] = { '/' };
-static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts;
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);
+    stmts++;
+  }
+  free(x);
 
-static const char mpc_escape_input_raw_cstr[] = { '"' };
-static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+}
 
-static const char mpc_escape_input_raw_cchar[] = { '\'' };
-static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+static void mpc_optimise_dispatch_unretained(mpc_parser_t *p, int force);
 
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   int i;
-  int found;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
-
-  while (*s) {
-
-    i = 0;
-    found = 0;
-
-    while (output[i]) {
-      if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
-        found = 1;
-        break;
-      }
-      i++;
-    }
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    mpc_optimise(stmt->grammar);
+    mpc_define(left, stmt->grammar);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
 
-    s++;
+  /* Rules can refer to ones defined after them, so redo the tables now all are known */
+  for (i = 0; i < st->parsers_num; i++) {
+    if (st->parsers[i]) { mpc_optimise_dispatch_unretained(st->parsers[i], 1); }
   }
 
+  free(x);
 
-  return y;
+  return NULL;
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
 
-  int i;
-  int found = 0;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
 
-  while (*s) {
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
 
-    i = 0;
-    found = 0;
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
+  ));
 
-    while (output[i]) {
-      if ((*(s+0)) == output[i][0] &&
-          (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 1 + 1);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
-        found = 1;
-        s++;
-        break;
-      }
-      i++;
-    }
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
+  ));
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 1 + 1);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
+  ));
 
-    if (*s == '\0') { break; }
-    else { s++; }
-  }
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
 
-  return y;
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
 
-}
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
-}
+  mpc_optimise(Lang);
+  mpc_optimise(Stmt);
+  mpc_optimise(Grammar);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
-}
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
+  }
 
-mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
-}
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
+  return e;
 }
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+  va_list va;
+  va_start(va, f);
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+  mpca_grammar_st_init(&st, &va, flags);
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  mpca_grammar_st_delete(&st);
+  va_end(va);
+  return err;
 }
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-  int i;
-  for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
-  }
-  return xs[x];
-}
+  va_list va;
+  va_start(va, p);
+
+  mpca_grammar_st_init(&st, &va, flags);
 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
-mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
-  int i;
-  for (i = 0; i < n; i++) {
-    free(xs[i]);
-  }
-  return NULL;
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  mpca_grammar_st_delete(&st);
+  va_end(va);
+  return err;
 }
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  int i;
-  size_t l = 0;
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
 
-  if (n == 0) { return calloc(1, 1); }
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  va_list va;
+  va_start(va, language);
 
-  xs[0] = realloc(xs[0], l + 1);
+  mpca_grammar_st_init(&st, &va, flags);
 
-  for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
-  }
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  return xs[0];
+  mpca_grammar_st_delete(&st);
+  va_end(va);
+  return err;
 }
 
-/*
-** Printing
-*/
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-  /* TODO: Print Everything Escaped */
+  va_list va;
 
-  int i;
-  char *s, *e;
-  char buff[2];
+  FILE *f = fopen(filename, "rb");
 
-  if (p->retained && !force) {;
-    if (p->name) { printf("<%s>", p->name); }
-    else { printf("<anon>"); }
-    return;
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
   }
 
-  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-  if (p->type == MPC_TYPE_EXPECT) {
-    printf("%s", p->data.expect.m);
-    /*mpc_print_unretained(p->data.expect.x, 0);*/
-  }
+  va_start(va, filename);
 
-  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+  mpca_grammar_st_init(&st, &va, flags);
 
-  if (p->type == MPC_TYPE_SINGLE) {
-    buff[0] = p->data.single.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("'%s'", s);
-    free(s);
-  }
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    buff[0] = p->data.range.y; buff[1] = '\0';
-    e = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s-%s]", s, e);
-    free(s);
-    free(e);
-  }
+  mpca_grammar_st_delete(&st);
+  va_end(va);
 
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
-  }
+  fclose(f);
 
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
-  }
+  return err;
+}
 
-  if (p->type == MPC_TYPE_STRING) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("\"%s\"", s);
-    free(s);
-  }
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
-  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  int i, total;
 
-  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+  if (p->retained && !force) { return 0; }
 
-  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MATCH)    { return 1 + mpc_nodecount_unretained(p->data.match.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
+
+  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
   if (p->type == MPC_TYPE_OR) {
-    printf("(");
-    for(i = 0; i < p->data.or.n-1; i++) {
-      mpc_print_unretained(p->data.or.xs[i], 0);
-      printf(" | ");
+    total = 1;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
     }
-    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-    printf(")");
+    return total;
   }
 
   if (p->type == MPC_TYPE_AND) {
-    printf("(");
-    for(i = 0; i < p->data.and.n-1; i++) {
-      mpc_print_unretained(p->data.and.xs[i], 0);
-      printf(" ");
+    total = 1;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
     }
-    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-    printf(")");
+    return total;
   }
 
-  if (p->type == MPC_TYPE_CHECK) {
-    mpc_print_unretained(p->data.check.x, 0);
-    printf("->?");
-  }
-  if (p->type == MPC_TYPE_CHECK_WITH) {
-    mpc_print_unretained(p->data.check_with.x, 0);
-    printf("->?");
+  return 1;
+
+}
+
+static int mpc_typecount_unretained(mpc_parser_t* p, int force, int type) {
+
+  int i, total;
+
+  if (p->retained && !force) { return 0; }
+
+  total = p->type == type;
+  for (i = 0; i < mpc_program_arity(p); i++) {
+    total += mpc_typecount_unretained(mpc_program_child(p, i), 0, type);
   }
+  return total;
 
 }
 
-void mpc_print(mpc_parser_t *p) {
-  mpc_print_unretained(p, 1);
-  printf("\n");
+void mpc_stats(mpc_parser_t* p) {
+  printf("Stats\n");
+  printf("=====\n");
+  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Matchers: %i (%i class sets)\n",
+    mpc_typecount_unretained(p, 1, MPC_TYPE_MATCH),
+    mpc_typecount_unretained(p, 1, MPC_TYPE_SET));
+  printf("Spans: %i\n", mpc_typecount_unretained(p, 1, MPC_TYPE_SPAN));
+  if (p->stats && p->stats->parses) {
+    printf("Parses: %li\n", p->stats->parses);
+    printf("Allocations: %li (%li pooled, %li malloc)\n",
+      p->stats->allocs, p->stats->pooled, p->stats->fallbacks);
+    printf("Pool Chunks: %li (%li bytes)\n", p->stats->chunks, p->stats->chunk_bytes);
+    printf("Pool Peak: %li bytes\n", p->stats->peak);
+    if (p->stats->memo_lookups) {
+      printf("Memo Hits: %li of %li (%.1f%%, %li stored, %li evicted)\n",
+        p->stats->memo_hits, p->stats->memo_lookups,
+        100.0 * p->stats->memo_hits / p->stats->memo_lookups,
+        p->stats->memo_stores, p->stats->memo_evictions);
+    }
+    if (p->stats->match_runs || p->stats->match_fallbacks) {
+      printf("Matcher Runs: %li (%li fell back)\n",
+        p->stats->match_runs + p->stats->match_fallbacks, p->stats->match_fallbacks);
+    }
+  }
 }
 
 /*
-** Testing
+** The profile lists every named parser reachable
+** from the one given which has been run, slowest
+** first. Times include the parsers a rule calls.
 */
 
-/*
-** These functions are slightly unwieldy and
-** also the whole of the testing suite for mpc
-** mpc is pretty shaky.
-**
-** It could do with a lot more tests and more
-** precision. Currently I am only really testing
-** changes off of the examples.
-**
-*/
+static int mpc_profile_cmp(const void *a, const void *b) {
+  const mpc_stats_t *x = (*(mpc_parser_t* const*)a)->stats;
+  const mpc_stats_t *y = (*(mpc_parser_t* const*)b)->stats;
+  if (x->ticks != y->ticks) { return x->ticks < y->ticks ? 1 : -1; }
+  if (x->calls != y->calls) { return x->calls < y->calls ? 1 : -1; }
+  return strcmp((*(mpc_parser_t* const*)a)->name, (*(mpc_parser_t* const*)b)->name);
+}
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
-  mpc_result_t r;
-  (void) printer;
-  if (mpc_parse("<test>", s, p, &r)) {
+static mpc_parser_t **mpc_profile_rules(mpc_parser_t *p, int *n) {
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 0;
-    } else {
-      destructor(r.output);
-      return 1;
-    }
+  int j;
+  mpc_parser_t *q, **rules;
+  mpc_program_t *g = mpc_program_new(p);
 
-  } else {
-    mpc_err_delete(r.error);
-    return 1;
+  rules = malloc(sizeof(mpc_parser_t*) * g->insts_num);
+  for (j = 0, *n = 0; j < g->insts_num; j++) {
+    q = g->insts[j].p;
+    if (q->name && q->stats && q->stats->calls) { rules[(*n)++] = q; }
   }
+  mpc_program_delete(g);
 
+  qsort(rules, *n, sizeof(mpc_parser_t*), mpc_profile_cmp);
+  return rules;
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
+static double mpc_profile_ms(mpc_stats_t *s) {
+  return 1000.0 * (double)s->ticks / CLOCKS_PER_SEC;
+}
 
-  mpc_result_t r;
-  if (mpc_parse("<test>", s, p, &r)) {
+void mpc_profile(mpc_parser_t *p) {
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
-    }
+  int j, n, w = 4;
+  mpc_stats_t *s;
+  mpc_parser_t **rules = mpc_profile_rules(p, &n);
 
-  } else {
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
+  for (j = 0; j < n; j++) {
+    if ((int)strlen(rules[j]->name) > w) { w = (int)strlen(rules[j]->name); }
+  }
 
+  printf("Profile\n");
+  printf("=======\n");
+  printf("%-*s %10s %10s %10s %10s %12s %10s\n", w,
+    "Rule", "Calls", "Matched", "Failed", "Rewinds", "Bytes", "Time (ms)");
+  for (j = 0; j < n; j++) {
+    s = rules[j]->stats;
+    printf("%-*s %10li %10li %10li %10li %12li %10.3f\n", w, rules[j]->name,
+      s->calls, s->successes, s->calls - s->successes, s->backtracks,
+      s->consumed, mpc_profile_ms(s));
+  }
+
+  free(rules);
+}
+
+void mpc_profile_csv(mpc_parser_t *p, FILE *f) {
+
+  int j, n;
+  mpc_stats_t *s;
+  mpc_parser_t **rules = mpc_profile_rules(p, &n);
+
+  fprintf(f, "rule,calls,matched,failed,rewinds,bytes,ms\n");
+  for (j = 0; j < n; j++) {
+    s = rules[j]->stats;
+    fprintf(f, "%s,%li,%li,%li,%li,%li,%.3f\n", rules[j]->name,
+      s->calls, s->successes, s->calls - s->successes, s->backtracks,
+      s->consumed, mpc_profile_ms(s));
   }
 
+  free(rules);
 }
 
-
 /*
-** AST
+** First Sets
+**
+** The first set of a parser holds every byte that
+** can begin input it matches, and whether it can
+** match without consuming anything. An `or` keeps
+** a table from each byte to the single alternative
+** able to start with it, so parsing tries that one
+** before anything else. Bytes that more than one
+** alternative can start with, and alternatives that
+** can match nothing, are left to the usual order.
 */
 
-void mpc_ast_delete(mpc_ast_t *a) {
+enum {
+  MPC_FIRST_DEPTH = 32,
+  MPC_FIRST_BUDGET = 4096
+};
 
-  int i;
+typedef struct {
+  unsigned char bytes[32];
+  int nullable;
+} mpc_first_t;
 
-  if (a == NULL) { return; }
+static void mpc_first_all(mpc_first_t *f) {
+  memset(f->bytes, 0xFF, sizeof(f->bytes));
+  f->nullable = 1;
+}
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
-  }
+static void mpc_first_add(mpc_first_t *f, int b) { f->bytes[b / 8] |= (unsigned char)(1 << (b % 8)); }
+static int mpc_first_has(mpc_first_t *f, int b) { return (f->bytes[b / 8] >> (b % 8)) & 1; }
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+static void mpc_first(mpc_parser_t *p, mpc_first_t *f, int depth, int *budget) {
 
-}
+  int b, j;
+  char c;
+  mpc_parser_t *x = NULL;
+  mpc_first_t g;
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
-}
+  memset(f, 0, sizeof(mpc_first_t));
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  /* Anything too deep or still undefined could match anything */
+  if (depth == MPC_FIRST_DEPTH || --(*budget) < 0) { mpc_first_all(f); return; }
 
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  switch (p->type) {
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+    case MPC_TYPE_FAIL: return;
 
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      f->nullable = 1;
+      return;
 
-  a->state = mpc_state_new();
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SET:
+      mpc_class_of(p, f->bytes);
+      return;
+
+    case MPC_TYPE_SATISFY:
+      for (b = 1; b < 256; b++) {
+        c = (char)b;
+        if (p->data.satisfy.f(c)) { mpc_first_add(f, b); }
+      }
+      return;
 
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(f, (unsigned char)p->data.string.x[0]); }
+      else { f->nullable = 1; }
+      return;
+
+    case MPC_TYPE_EXPECT:     x = p->data.expect.x;     break;
+    case MPC_TYPE_APPLY:      x = p->data.apply.x;      break;
+    case MPC_TYPE_APPLY_TO:   x = p->data.apply_to.x;   break;
+    case MPC_TYPE_CHECK:      x = p->data.check.x;      break;
+    case MPC_TYPE_CHECK_WITH: x = p->data.check_with.x; break;
+    case MPC_TYPE_PREDICT:    x = p->data.predict.x;    break;
+    case MPC_TYPE_MATCH:      x = p->data.match.x;      break;
+    case MPC_TYPE_SPAN:       x = p->data.span.x;       break;
+    case MPC_TYPE_MANY1:      x = p->data.repeat.x;     break;
 
-}
+    case MPC_TYPE_MAYBE:
+      mpc_first(p->data.not.x, f, depth+1, budget);
+      f->nullable = 1;
+      return;
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_COUNT:
+      mpc_first(p->data.repeat.x, f, depth+1, budget);
+      if (p->type == MPC_TYPE_MANY || p->data.repeat.n < 1) { f->nullable = 1; }
+      return;
 
-  mpc_ast_t *a = mpc_ast_new(tag, "");
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_first(p->data.or.xs[j], &g, depth+1, budget);
+        for (b = 0; b < 32; b++) { f->bytes[b] |= g.bytes[b]; }
+        f->nullable |= g.nullable;
+      }
+      if (p->data.or.n == 0) { f->nullable = 1; }
+      return;
 
-  int i;
-  va_list va;
-  va_start(va, tag);
+    case MPC_TYPE_AND:
+      f->nullable = 1;
+      for (j = 0; j < p->data.and.n && f->nullable; j++) {
+        mpc_first(p->data.and.xs[j], &g, depth+1, budget);
+        for (b = 0; b < 32; b++) { f->bytes[b] |= g.bytes[b]; }
+        f->nullable = g.nullable;
+      }
+      return;
 
-  for (i = 0; i < n; i++) {
-    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+    default:
+      mpc_first_all(f);
+      return;
   }
 
-  va_end(va);
-
-  return a;
-
+  mpc_first(x, f, depth+1, budget);
 }
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
-
-  mpc_ast_t *r;
-
-  if (a == NULL) { return a; }
-  if (a->children_num == 0) { return a; }
-  if (a->children_num == 1) { return a; }
+static void mpc_optimise_dispatch(mpc_parser_t *p) {
 
-  r = mpc_ast_new(">", "");
-  mpc_ast_add_child(r, a);
-  return r;
-}
+  int b, j, found = 0, budget = MPC_FIRST_BUDGET;
+  int nullable = p->data.or.n;
+  unsigned char *first;
+  mpc_first_t f;
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+  free(p->data.or.first);
+  p->data.or.first = NULL;
 
-  int i;
+  if (p->data.or.n < 2 || p->data.or.n > 254) { return; }
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
-  if (a->children_num != b->children_num) { return 0; }
+  first = calloc(256, 1);
 
-  for (i = 0; i < a->children_num; i++) {
-    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  for (j = 0; j < p->data.or.n; j++) {
+    mpc_first(p->data.or.xs[j], &f, 0, &budget);
+    if (budget < 0) { free(first); return; }
+    if (f.nullable) {
+      if (nullable == p->data.or.n) { nullable = j; }
+      continue;
+    }
+    for (b = 1; b < 256; b++) {
+      if (!mpc_first_has(&f, b)) { continue; }
+      first[b] = first[b] ? 0xFF : (unsigned char)(j + 1);
+    }
   }
 
-  return 1;
-}
+  /* Nothing after an alternative that can match nothing is certain to fail */
+  for (b = 1; b < 256; b++) {
+    if (first[b] == 0xFF || first[b] > nullable) { first[b] = 0; }
+    if (first[b]) { found = 1; }
+  }
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
-  return r;
+  if (found) { p->data.or.first = first; } else { free(first); }
 }
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
-  return a;
-}
+static void mpc_optimise_dispatch_unretained(mpc_parser_t *p, int force) {
 
-mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
-  return a;
-}
+  int i;
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
-}
+  if (p->retained && !force) { return; }
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-  if (a == NULL) { return a; }
-  a->state = s;
-  return a;
-}
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     mpc_optimise_dispatch_unretained(p->data.expect.x, 0);     break;
+    case MPC_TYPE_APPLY:      mpc_optimise_dispatch_unretained(p->data.apply.x, 0);      break;
+    case MPC_TYPE_APPLY_TO:   mpc_optimise_dispatch_unretained(p->data.apply_to.x, 0);   break;
+    case MPC_TYPE_CHECK:      mpc_optimise_dispatch_unretained(p->data.check.x, 0);      break;
+    case MPC_TYPE_CHECK_WITH: mpc_optimise_dispatch_unretained(p->data.check_with.x, 0); break;
+    case MPC_TYPE_PREDICT:    mpc_optimise_dispatch_unretained(p->data.predict.x, 0);    break;
+    case MPC_TYPE_MATCH:      mpc_optimise_dispatch_unretained(p->data.match.x, 0);      break;
+    case MPC_TYPE_SPAN:       mpc_optimise_dispatch_unretained(p->data.span.x, 0);       break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      mpc_optimise_dispatch_unretained(p->data.not.x, 0);        break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      mpc_optimise_dispatch_unretained(p->data.repeat.x, 0);     break;
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_optimise_dispatch_unretained(p->data.or.xs[i], 0); }
+      mpc_optimise_dispatch(p);
+      break;
 
-  int i;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_optimise_dispatch_unretained(p->data.and.xs[i], 0); }
+      break;
 
-  if (a == NULL) {
-    fprintf(fp, "NULL\n");
-    return;
+    default: break;
   }
+}
 
-  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+/*
+** A run of alternatives which each match one byte
+** from a fixed set becomes a single set parser. It
+** keeps every expectation of the run so it fails,
+** and merges errors while succeeding, as they did.
+*/
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
-      (long unsigned int)(a->state.row+1),
-      (long unsigned int)(a->state.col+1),
-      a->contents);
-  } else {
-    fprintf(fp, "%s \n", a->tag);
-  }
+enum {
+  MPC_SET_EXPECTED_MAX = 254
+};
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_print_depth(a->children[i], d+1, fp);
-  }
+static int mpc_optimise_set_alt(mpc_parser_t *p, unsigned char *set, int *n) {
 
-}
+  mpc_parser_t *x = p;
 
-void mpc_ast_print(mpc_ast_t *a) {
-  mpc_ast_print_depth(a, 0, stdout);
-}
+  if (p->retained) { return 0; }
+  while (!x->retained && x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  if (x->retained || !mpc_class_of(x, set)) { return 0; }
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-  mpc_ast_print_depth(a, 0, fp);
+  *n = p->type == MPC_TYPE_EXPECT ? 1 : p->type == MPC_TYPE_SET ? p->data.set.n : 0;
+  return 1;
 }
 
-int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_index_lb(ast, tag, 0);
-}
+static mpc_parser_t *mpc_optimise_set_new(mpc_parser_t **xs, int n, int total) {
 
-int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
+  int j, k, b, m;
+  unsigned char set[32];
+  unsigned char *skip;
+  mpc_parser_t *p = mpc_undefined();
 
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return i;
-    }
-  }
+  p->type = MPC_TYPE_SET;
+  p->data.set.x = calloc(32, 1);
+  p->data.set.n = 0;
+  p->data.set.ms = malloc(sizeof(char*) * (total ? total : 1));
+  p->data.set.skip = skip = malloc(256);
 
-  return -1;
-}
+  /* Bytes still unclaimed by an earlier alternative are marked with 0xFF */
+  memset(skip, 0xFF, 256);
 
-mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_child_lb(ast, tag, 0);
-}
+  for (j = 0; j < n; j++) {
 
-mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
+    mpc_optimise_set_alt(xs[j], set, &m);
 
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return ast->children[i];
+    for (b = 0; b < 256; b++) {
+      if (skip[b] == 0xFF && MPC_CLASS_HAS(set, b)) {
+        skip[b] = (unsigned char)(p->data.set.n + (xs[j]->type == MPC_TYPE_SET ? xs[j]->data.set.skip[b] : 0));
+      }
+    }
+    for (b = 0; b < 32; b++) { p->data.set.x[b] |= set[b]; }
+
+    for (k = 0; k < m; k++) {
+      char *e = xs[j]->type == MPC_TYPE_EXPECT ? xs[j]->data.expect.m : xs[j]->data.set.ms[k];
+      p->data.set.ms[p->data.set.n] = malloc(strlen(e) + 1);
+      strcpy(p->data.set.ms[p->data.set.n], e);
+      p->data.set.n++;
     }
   }
 
-  return NULL;
-}
+  for (b = 0; b < 256; b++) {
+    if (skip[b] == 0xFF) { skip[b] = (unsigned char)p->data.set.n; }
+  }
 
-mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
-                                       mpc_ast_trav_order_t order)
-{
-  mpc_ast_trav_t *trav, *n_trav;
-  mpc_ast_t *cnode = ast;
+  return p;
+}
 
-  /* Create the traversal structure */
-  trav = malloc(sizeof(mpc_ast_trav_t));
-  trav->curr_node = cnode;
-  trav->parent = NULL;
-  trav->curr_child = 0;
-  trav->order = order;
+static int mpc_optimise_set(mpc_parser_t *p) {
 
-  /* Get start node */
-  switch(order) {
-    case mpc_ast_trav_order_pre:
-      /* Nothing else is needed for pre order start */
-      break;
+  int j, k, m, total = 0;
+  unsigned char set[32];
+  mpc_parser_t *t;
 
-    case mpc_ast_trav_order_post:
-      while(cnode->children_num > 0) {
-        cnode = cnode->children[0];
+  /* Find the first run of at least two */
+  for (j = 0, k = 0; j < p->data.or.n; j = k > j ? k : j + 1) {
+    total = 0;
+    for (k = j; k < p->data.or.n; k++) {
+      if (!mpc_optimise_set_alt(p->data.or.xs[k], set, &m)
+      ||  total + m > MPC_SET_EXPECTED_MAX) { break; }
+      total += m;
+    }
+    if (k - j >= 2) { break; }
+  }
 
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-        n_trav->curr_node = cnode;
-        n_trav->parent = trav;
-        n_trav->curr_child = 0;
-        n_trav->order = order;
+  if (j >= p->data.or.n) { return 0; }
 
-        trav = n_trav;
-      }
+  t = mpc_optimise_set_new(p->data.or.xs + j, k - j, total);
+  for (m = j; m < k; m++) { mpc_delete(p->data.or.xs[m]); }
 
-      break;
+  free(p->data.or.first);
+  p->data.or.first = NULL;
 
-    default:
-      /* Unreachable, but compiler complaints */
-      break;
+  if (k - j == p->data.or.n) {
+    free(p->data.or.xs);
+    p->type = MPC_TYPE_SET;
+    p->data.set = t->data.set;
+    free(t);
+    return 1;
   }
 
-  return trav;
+  p->data.or.xs[j] = t;
+  memmove(p->data.or.xs + j + 1, p->data.or.xs + k, (p->data.or.n - k) * sizeof(mpc_parser_t*));
+  p->data.or.n -= k - j - 1;
+  return 1;
 }
 
-mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav, *to_free;
-  mpc_ast_t *ret = NULL;
-  int cchild;
-
-  /* The end of traversal was reached */
-  if(*trav == NULL) return NULL;
+static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
-  switch((*trav)->order) {
-    case mpc_ast_trav_order_pre:
-      ret = (*trav)->curr_node;
+  int i, n, m;
+  mpc_parser_t *t;
+  mpc_stats_t *s;
+  mpc_program_t *g;
 
-      /* If there aren't any more children, go up */
-      while(*trav != NULL &&
-        (*trav)->curr_child >= (*trav)->curr_node->children_num)
-      {
-        to_free = *trav;
-        *trav = (*trav)->parent;
-        free(to_free);
-      }
+  if (p->retained && !force) { return; }
 
-      /* If trav is NULL, the end was reached */
-      if(*trav == NULL) {
-        break;
-      }
+  /* Optimise Subexpressions */
 
-      /* Go to next child */
-      n_trav = malloc(sizeof(mpc_ast_trav_t));
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
 
-      cchild = (*trav)->curr_child;
-      n_trav->curr_node = (*trav)->curr_node->children[cchild];
-      n_trav->parent = *trav;
-      n_trav->curr_child = 0;
-      n_trav->order = (*trav)->order;
+  if (p->type == MPC_TYPE_OR) {
+    for(i = 0; i < p->data.or.n; i++) {
+      mpc_optimise_unretained(p->data.or.xs[i], 0);
+    }
+  }
 
-      (*trav)->curr_child++;
-      *trav = n_trav;
+  if (p->type == MPC_TYPE_AND) {
+    for(i = 0; i < p->data.and.n; i++) {
+      mpc_optimise_unretained(p->data.and.xs[i], 0);
+    }
+  }
 
-      break;
+  /* Perform optimisations */
 
-    case mpc_ast_trav_order_post:
-      ret = (*trav)->curr_node;
+  while (1) {
 
-      /* Move up tree to the parent If the parent doesn't have any more nodes,
-       * then this is the current node. If it does, move down to its left most
-       * child. Also, free the previous traversal node */
-      to_free = *trav;
-      *trav = (*trav)->parent;
-      free(to_free);
+    /* Merge rhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
+    && !p->data.or.xs[p->data.or.n-1]->retained) {
+      t = p->data.or.xs[p->data.or.n-1];
+      n = p->data.or.n; m = t->data.or.n;
+      free(p->data.or.first); free(t->data.or.first);
+      p->data.or.first = NULL;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->name); free(t);
+      continue;
+    }
 
-      if(*trav == NULL)
-        break;
+    /* Merge lhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      n = p->data.or.n; m = t->data.or.n;
+      free(p->data.or.first); free(t->data.or.first);
+      p->data.or.first = NULL;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->name); free(t);
+      continue;
+    }
 
-      /* Next child */
-      (*trav)->curr_child++;
+    /* Merge character class `or` */
+    if (p->type == MPC_TYPE_OR && mpc_optimise_set(p)) { continue; }
 
-      /* If there aren't any more children, this is the next node */
-      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
-        break;
-      }
+    /* Remove ast `pass` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      s = p->stats;
+      g = p->program;
+      memcpy(p, t, sizeof(mpc_parser_t));
+      p->stats = s;
+      p->program = g;
+      free(t);
+      continue;
+    }
 
-      /* If there are still more children, find the leftmost child from this
-       * node */
-      while((*trav)->curr_node->children_num > 0) {
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
+    /* Merge ast lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      continue;
+    }
 
-        cchild = (*trav)->curr_child;
-        n_trav->curr_node = (*trav)->curr_node->children[cchild];
-        n_trav->parent = *trav;
-        n_trav->curr_child = 0;
-        n_trav->order = (*trav)->order;
+    /* Merge ast rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      continue;
+    }
 
-        *trav = n_trav;
-      }
+    /* Remove re `lift` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
+    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      s = p->stats;
+      g = p->program;
+      memcpy(p, t, sizeof(mpc_parser_t));
+      p->stats = s;
+      p->program = g;
+      free(t);
+      continue;
+    }
 
-    default:
-      /* Unreachable, but compiler complaints */
-      break;
-  }
+    /* Merge re lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      continue;
+    }
 
-  return ret;
-}
+    /* Merge re rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      continue;
+    }
 
-void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav;
+    return;
 
-  /* Go through parents until all are free */
-  while(*trav != NULL) {
-      n_trav = (*trav)->parent;
-      free(*trav);
-      *trav = n_trav;
   }
-}
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+}
 
-  int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_ast_t *r;
+/*
+** The largest subtrees a table matcher can run
+** are found top down and the node at the top is
+** turned into one in place, taking a copy of its
+** old self to fall back on.
+*/
 
-  if (n == 0) { return NULL; }
-  if (n == 1) { return xs[0]; }
-  if (n == 2 && xs[1] == NULL) { return xs[0]; }
-  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+static void mpc_optimise_match_unretained(mpc_parser_t *p, int force) {
 
-  r = mpc_ast_new(">", "");
+  int j;
+  mpc_match_t *m;
+  mpc_parser_t *t;
 
-  for (i = 0; i < n; i++) {
+  if (p->retained && !force) { return; }
+  if (p->type == MPC_TYPE_MATCH) { return; }
 
-    if (as[i] == NULL) { continue; }
+  m = mpc_match_new(p);
 
-    if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
-      mpc_ast_delete_no_children(as[i]);
-    } else if (as[i] && as[i]->children_num >= 2) {
-      for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
-      }
-      mpc_ast_delete_no_children(as[i]);
+  if (m == NULL) {
+    for (j = 0; j < mpc_program_arity(p); j++) {
+      mpc_optimise_match_unretained(mpc_program_child(p, j), 0);
     }
-
+    return;
   }
 
-  if (r->children_num) {
-    r->state = r->children[0]->state;
-  }
+  t = malloc(sizeof(mpc_parser_t));
+  memcpy(t, p, sizeof(mpc_parser_t));
+  t->name = NULL;
+  t->retained = 0;
+  t->stats = NULL;
+  t->program = NULL;
 
-  return r;
+  p->type = MPC_TYPE_MATCH;
+  p->data.match.x = t;
+  p->data.match.m = m;
 }
 
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
-}
+/*
+** A parser can go under a span if its output is
+** always the input it consumed. Returns how many
+** folds that saves, or -1 if it can't. `rewound` is
+** set when a failure of the parser is undone by
+** the sequence it is in, or fails the whole span,
+** so it may fail after consuming input.
+*/
 
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  (void)n;
-  a = mpc_ast_state(a, *s);
-  free(s);
-  return a;
-}
+static int mpc_span_of(mpc_parser_t *p, int rewound);
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+static int mpc_span_child(mpc_parser_t *x, int rewound) {
+  return x->retained ? -1 : mpc_span_of(x, rewound);
 }
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
-}
+static int mpc_span_of(mpc_parser_t *p, int rewound) {
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
-}
+  int j, k, n;
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
-}
+  switch (p->type) {
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_SET:
+      return 0;
 
-mpc_parser_t *mpca_or(int n, ...) {
+    case MPC_TYPE_LIFT:
+      return p->data.lift.lf == mpcf_ctor_str ? 0 : -1;
 
-  int i;
-  va_list va;
+    case MPC_TYPE_MATCH:
+      if (p->data.match.m == NULL || p->data.match.m->discard) { return -1; }
+      if (rewound || p->data.match.m->rewind) { return 0; }
+      return p->data.match.m->items[0].type == MPC_TYPE_COUNT ? -1 : 0;
+
+    case MPC_TYPE_EXPECT:
+      return mpc_span_child(p->data.expect.x, rewound);
 
-  mpc_parser_t *p = mpc_undefined();
+    case MPC_TYPE_NOT:
+      if (p->data.not.lf != mpcf_ctor_str || p->data.not.dx != free) { return -1; }
+      return mpc_span_child(p->data.not.x, 0) < 0 ? -1 : 0;
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      return mpc_span_child(p->data.not.x, 0);
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  va_end(va);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      if (p->type == MPC_TYPE_COUNT && (!rewound || p->data.repeat.dx != free)) { return -1; }
+      k = mpc_span_child(p->data.repeat.x, p->type == MPC_TYPE_COUNT);
+      return k < 0 ? -1 : k + 1;
 
-  return p;
+    case MPC_TYPE_OR:
+      /* Any alternative might be tried first */
+      for (j = 0, n = 0; j < p->data.or.n; j++) {
+        k = mpc_span_child(p->data.or.xs[j], 0);
+        if (k < 0) { return -1; }
+        n += k;
+      }
+      return n;
 
-}
+    case MPC_TYPE_AND:
+      /* An empty string after an anchor, as regexes use */
+      if (p->data.and.f == mpcf_snd && p->data.and.n == 2
+      &&  p->data.and.dxs[0] == free
+      && !p->data.and.xs[0]->retained
+      && (p->data.and.xs[0]->type == MPC_TYPE_ANCHOR
+      ||  p->data.and.xs[0]->type == MPC_TYPE_SOI
+      ||  p->data.and.xs[0]->type == MPC_TYPE_EOI)) {
+        return mpc_span_child(p->data.and.xs[1], 0) == 0
+          && p->data.and.xs[1]->type == MPC_TYPE_LIFT ? 0 : -1;
+      }
+      if (p->data.and.f != mpcf_strfold) { return -1; }
+      for (j = 0, n = 1; j < p->data.and.n; j++) {
+        if (j < p->data.and.n-1 && p->data.and.dxs[j] != free) { return -1; }
+        k = mpc_span_child(p->data.and.xs[j], 1);
+        if (k < 0) { return -1; }
+        n += k;
+      }
+      return n;
 
-mpc_parser_t *mpca_and(int n, ...) {
+    default: return -1;
+  }
+}
 
-  int i;
-  va_list va;
+static void mpc_optimise_span_unretained(mpc_parser_t *p, int force) {
 
-  mpc_parser_t *p = mpc_undefined();
+  int j;
+  mpc_parser_t *t;
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = mpcf_fold_ast;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  if (p->retained && !force) { return; }
+  if (p->type == MPC_TYPE_MATCH || p->type == MPC_TYPE_SPAN) { return; }
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  if (mpc_span_of(p, 1) <= 0) {
+    for (j = 0; j < mpc_program_arity(p); j++) {
+      mpc_optimise_span_unretained(mpc_program_child(p, j), 0);
+    }
+    return;
   }
-  va_end(va);
 
-  return p;
+  t = malloc(sizeof(mpc_parser_t));
+  memcpy(t, p, sizeof(mpc_parser_t));
+  t->name = NULL;
+  t->retained = 0;
+  t->stats = NULL;
+  t->program = NULL;
+
+  p->type = MPC_TYPE_SPAN;
+  p->data.span.x = t;
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_program_delete(p->program);
+  p->program = NULL;
+  mpc_optimise_unretained(p, 1);
+  mpc_optimise_match_unretained(p, 1);
+  mpc_optimise_span_unretained(p, 1);
+  mpc_optimise_dispatch_unretained(p, 1);
+}
 
-/*
-** Grammar Parser
-*/
 
 /*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
+** Snapshots
 */
 
 /*
+** A snapshot is a flat binary image of a set
+** of parser graphs, taken after they have been
+** built and optimised, so that they can be
+** loaded again without running the grammar
+** compiler at all.
 **
-**  ### Grammar Grammar
+** Parsers are stored in a table and refer to
+** each other by index. The first entries are
+** the retained parsers passed by the user,
+** which are matched up again by name on load.
 **
-**      <grammar> : (<term> "|" <grammar>) | <term>
+** Functions can't be written out so only the
+** ones mpc itself uses to build grammars are
+** supported, by their position in the table
+** below. Graphs using anything else (such as
+** `mpc_satisfy` or `mpc_check` with user
+** functions) can't be snapshotted.
 **
-**      <term> : <factor>*
+**  ### Layout (integers are big endian)
 **
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
+**      "MPCS" <version:u8>
+**      <roots:u32>  { <name:str> }
+**      <nodes:u32>  { <type:u8> <data...> }
+**      <check:u32>
 **
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit> <regex_mode>
-**             | "(" <grammar> ")"
+**      <str> : <length:u32> <bytes>
+**
+** The check is a 32 bit FNV-1a hash of all the
+** bytes before it, so damage which still leaves
+** a well formed graph (a changed tag or fold)
+** is caught too.
 */
 
-typedef struct {
-  va_list *va;
-  int parsers_num;
-  mpc_parser_t **parsers;
-  int flags;
-} mpca_grammar_st_t;
+enum {
+  MPC_SNAPSHOT_VERSION = 5
+};
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpca_or(2, xs[0], xs[1]); }
-}
+typedef void(*mpc_snapshot_fn_t)(void);
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_pass();
-  for (i = 0; i < n; i++) {
-    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
-  }
-  return p;
-}
+/*
+** Each function is stored with the kind of slot it
+** may fill, so a load can't put a destructor where
+** a fold is called, or leave a slot empty.
+*/
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
-    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
-    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
-    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
-    default:
-      num = *((int*)xs[1]);
-      free(xs[1]);
-  }
-  return mpca_count(num, xs[0]);
-}
+enum {
+  MPC_SNAPSHOT_FN_NONE,
+  MPC_SNAPSHOT_FN_DTOR,
+  MPC_SNAPSHOT_FN_CTOR,
+  MPC_SNAPSHOT_FN_APPLY,
+  MPC_SNAPSHOT_FN_APPLY_TO,
+  MPC_SNAPSHOT_FN_FOLD,
+  MPC_SNAPSHOT_FN_ANCHOR,
+  MPC_SNAPSHOT_FN_SATISFY
+};
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
-}
+typedef struct {
+  mpc_snapshot_fn_t f;
+  int kind;
+} mpc_snapshot_fn_entry_t;
+
+static const mpc_snapshot_fn_entry_t mpc_snapshot_fns[] = {
+  { NULL,                                           MPC_SNAPSHOT_FN_NONE },
+  { (mpc_snapshot_fn_t)free,                        MPC_SNAPSHOT_FN_DTOR },
+  { (mpc_snapshot_fn_t)mpcf_dtor_null,              MPC_SNAPSHOT_FN_DTOR },
+  { (mpc_snapshot_fn_t)mpcf_ctor_null,              MPC_SNAPSHOT_FN_CTOR },
+  { (mpc_snapshot_fn_t)mpcf_ctor_str,               MPC_SNAPSHOT_FN_CTOR },
+  { (mpc_snapshot_fn_t)mpcf_free,                   MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_int,                    MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_hex,                    MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_oct,                    MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_float,                  MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_strtriml,               MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_strtrimr,               MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_strtrim,                MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_escape,                 MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_escape_regex,           MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_escape_string_raw,      MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_escape_char_raw,        MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_unescape,               MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_unescape_regex,         MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_unescape_string_raw,    MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_unescape_char_raw,      MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_null,                   MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_fst,                    MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_snd,                    MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_trd,                    MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_fst_free,               MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_snd_free,               MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_trd_free,               MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_all_free,               MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_strfold,                MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_fold_ast,               MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpcf_str_ast,                MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpcf_state_ast,              MPC_SNAPSHOT_FN_FOLD },
+  { (mpc_snapshot_fn_t)mpc_ast_tag,                 MPC_SNAPSHOT_FN_APPLY_TO },
+  { (mpc_snapshot_fn_t)mpc_ast_add_tag,             MPC_SNAPSHOT_FN_APPLY_TO },
+  { (mpc_snapshot_fn_t)mpc_ast_add_root,            MPC_SNAPSHOT_FN_APPLY },
+  { (mpc_snapshot_fn_t)mpc_ast_add_root_tag,        MPC_SNAPSHOT_FN_APPLY_TO },
+  { (mpc_snapshot_fn_t)mpc_ast_delete,              MPC_SNAPSHOT_FN_DTOR },
+  { (mpc_snapshot_fn_t)mpc_delete,                  MPC_SNAPSHOT_FN_DTOR },
+  { (mpc_snapshot_fn_t)mpc_boundary_anchor,         MPC_SNAPSHOT_FN_ANCHOR },
+  { (mpc_snapshot_fn_t)mpc_boundary_newline_anchor, MPC_SNAPSHOT_FN_ANCHOR }
+};
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
-}
+enum {
+  MPC_SNAPSHOT_FNS_NUM = sizeof(mpc_snapshot_fns) / sizeof(mpc_snapshot_fn_entry_t)
+};
 
-static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
-  char *y = xs[0];
-  char *m = xs[1];
-  mpca_grammar_st_t *st = xs[2];
-  mpc_parser_t *p;
-  int mode = MPC_RE_DEFAULT;
+/* Tags `mpca_lang` applies to literals, everything else is tagged with a parser name */
+static const char *const mpc_snapshot_tags[] = { "string", "char", "regex" };
 
-  (void)n;
-  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
-  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
-  y = mpcf_unescape_regex(y);
-  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
-  free(y);
-  free(m);
+enum {
+  MPC_SNAPSHOT_TAGS_NUM = sizeof(mpc_snapshot_tags) / sizeof(char*)
+};
 
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
-}
+typedef struct {
+  FILE *f;
+  unsigned long check;
+  int roots_num;
+  int nodes_num;
+  int nodes_slots;
+  mpc_parser_t **nodes;
+  char *error;
+} mpc_snapshot_writer_t;
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-  size_t i;
-  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-  return 1;
+static void mpc_snapshot_failf(mpc_snapshot_writer_t *w, const char *fmt, const char *name) {
+  if (w->error) { return; }
+  if (name == NULL) { name = "<anon>"; }
+  w->error = malloc(strlen(fmt) + strlen(name) + 1);
+  sprintf(w->error, fmt, name);
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
-
-  int i;
-  mpc_parser_t *p;
-
-  /* Case of Number */
-  if (is_number(x)) {
-
-    i = strtol(x, NULL, 10);
-
-    while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-      if (st->parsers[st->parsers_num-1] == NULL) {
-        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
-      }
-    }
+static void mpc_snapshot_write_bytes(mpc_snapshot_writer_t *w, const char *s, size_t n) {
+  fwrite(s, 1, n, w->f);
+  w->check = mpc_fnv1a(s, n, w->check);
+}
 
-    return st->parsers[st->parsers_num-1];
+static void mpc_snapshot_write_u8(mpc_snapshot_writer_t *w, int x) {
+  char b = (char)(x & 0xFF);
+  mpc_snapshot_write_bytes(w, &b, 1);
+}
 
-  /* Case of Identifier */
-  } else {
+static void mpc_snapshot_write_u32(mpc_snapshot_writer_t *w, unsigned long x) {
+  char b[4];
+  b[0] = (char)((x >> 24) & 0xFF);
+  b[1] = (char)((x >> 16) & 0xFF);
+  b[2] = (char)((x >>  8) & 0xFF);
+  b[3] = (char)((x >>  0) & 0xFF);
+  mpc_snapshot_write_bytes(w, b, 4);
+}
 
-    /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
-    }
+static void mpc_snapshot_write_str(mpc_snapshot_writer_t *w, const char *s) {
+  size_t l = strlen(s);
+  mpc_snapshot_write_u32(w, l);
+  mpc_snapshot_write_bytes(w, s, l);
+}
 
-    /* Search New Parsers */
-    while (1) {
+static void mpc_snapshot_write_fn(mpc_snapshot_writer_t *w, mpc_parser_t *p, mpc_snapshot_fn_t f) {
+  int i;
+  for (i = 0; i < MPC_SNAPSHOT_FNS_NUM; i++) {
+    if (mpc_snapshot_fns[i].f == f) { mpc_snapshot_write_u8(w, i); return; }
+  }
+  mpc_snapshot_failf(w, "Parser '%s' uses a function that can't be snapshotted!", p->name);
+  mpc_snapshot_write_u8(w, 0);
+}
 
-      p = va_arg(*st->va, mpc_parser_t*);
+static int mpc_snapshot_index(mpc_snapshot_writer_t *w, mpc_parser_t *p) {
 
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
+  int i;
 
-      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
+  for (i = 0; i < w->nodes_num; i++) {
+    if (w->nodes[i] == p) { return i; }
+  }
 
-    }
+  if (p->retained) {
+    mpc_snapshot_failf(w, "Parser '%s' is referenced but not part of the snapshot!", p->name);
+    return 0;
+  }
 
+  if (w->nodes_num == w->nodes_slots) {
+    w->nodes_slots = w->nodes_slots * 2;
+    w->nodes = realloc(w->nodes, sizeof(mpc_parser_t*) * w->nodes_slots);
   }
 
+  w->nodes[w->nodes_num++] = p;
+  return w->nodes_num-1;
 }
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
-
-  mpca_grammar_st_t *st = s;
-  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-  free(x);
-
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
-  }
+static void mpc_snapshot_write_child(mpc_snapshot_writer_t *w, mpc_parser_t *x) {
+  mpc_snapshot_write_u32(w, mpc_snapshot_index(w, x));
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+static void mpc_snapshot_write_tag(mpc_snapshot_writer_t *w, mpc_parser_t *p, const char *t) {
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+  int i;
 
-  GrammarTotal = mpc_new("grammar_total");
-  Grammar = mpc_new("grammar");
-  Term = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base = mpc_new("base");
+  for (i = 0; i < w->roots_num; i++) {
+    if (w->nodes[i]->name == t) {
+      mpc_snapshot_write_u8(w, 1);
+      mpc_snapshot_write_u32(w, i);
+      return;
+    }
+  }
 
-  mpc_define(GrammarTotal,
-    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-  );
+  for (i = 0; i < MPC_SNAPSHOT_TAGS_NUM; i++) {
+    if (strcmp(mpc_snapshot_tags[i], t) == 0) {
+      mpc_snapshot_write_u8(w, 0);
+      mpc_snapshot_write_u32(w, i);
+      return;
+    }
+  }
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-    mpc_soft_delete
-  ));
+  mpc_snapshot_failf(w, "Parser '%s' applies a tag that can't be snapshotted!", p->name);
+  mpc_snapshot_write_u8(w, 0);
+  mpc_snapshot_write_u32(w, 0);
+}
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+static void mpc_snapshot_write_node(mpc_snapshot_writer_t *w, mpc_parser_t *p) {
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  int i;
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  mpc_snapshot_write_u8(w, p->type);
 
-  mpc_optimise(GrammarTotal);
-  mpc_optimise(Grammar);
-  mpc_optimise(Factor);
-  mpc_optimise(Term);
-  mpc_optimise(Base);
+  switch (p->type) {
 
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
-  }
+    case MPC_TYPE_FAIL: mpc_snapshot_write_str(w, p->data.fail.m); break;
 
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+    case MPC_TYPE_LIFT: mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.lift.lf); break;
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x != NULL) {
+        mpc_snapshot_failf(w, "Parser '%s' lifts a value that can't be snapshotted!", p->name);
+      }
+      break;
 
-  mpc_optimise(r.output);
+    case MPC_TYPE_EXPECT:
+      mpc_snapshot_write_child(w, p->data.expect.x);
+      mpc_snapshot_write_str(w, p->data.expect.m);
+      break;
 
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+    case MPC_TYPE_ANCHOR: mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.anchor.f); break;
+    case MPC_TYPE_SATISFY: mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.satisfy.f); break;
 
-}
+    case MPC_TYPE_SINGLE: mpc_snapshot_write_u8(w, p->data.single.x); break;
+    case MPC_TYPE_RANGE:
+      mpc_snapshot_write_u8(w, p->data.range.x);
+      mpc_snapshot_write_u8(w, p->data.range.y);
+      break;
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-  mpca_grammar_st_t st;
-  mpc_parser_t *res;
-  va_list va;
-  va_start(va, grammar);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_snapshot_write_str(w, p->data.string.x);
+      break;
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_SET:
+      for (i = 0; i < 32; i++) { mpc_snapshot_write_u8(w, p->data.set.x[i]); }
+      for (i = 0; i < 256; i++) { mpc_snapshot_write_u8(w, p->data.set.skip[i]); }
+      mpc_snapshot_write_u32(w, p->data.set.n);
+      for (i = 0; i < p->data.set.n; i++) { mpc_snapshot_write_str(w, p->data.set.ms[i]); }
+      break;
 
-  res = mpca_grammar_st(grammar, &st);
-  free(st.parsers);
-  va_end(va);
-  return res;
-}
+    case MPC_TYPE_APPLY:
+      mpc_snapshot_write_child(w, p->data.apply.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.apply.f);
+      break;
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
+    case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_tag
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_add_tag
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_add_root_tag) {
+        mpc_snapshot_failf(w, "Parser '%s' uses a function that can't be snapshotted!", p->name);
+      }
+      mpc_snapshot_write_child(w, p->data.apply_to.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.apply_to.f);
+      mpc_snapshot_write_tag(w, p, p->data.apply_to.d);
+      break;
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+    case MPC_TYPE_PREDICT: mpc_snapshot_write_child(w, p->data.predict.x); break;
+    case MPC_TYPE_MATCH:   mpc_snapshot_write_child(w, p->data.match.x);   break;
+    case MPC_TYPE_SPAN:    mpc_snapshot_write_child(w, p->data.span.x);    break;
 
-  return stmt;
-}
+    case MPC_TYPE_NOT:
+      mpc_snapshot_write_child(w, p->data.not.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.not.dx);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.not.lf);
+      break;
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+    case MPC_TYPE_MAYBE:
+      mpc_snapshot_write_child(w, p->data.not.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.not.lf);
+      break;
 
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_snapshot_write_child(w, p->data.repeat.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.repeat.f);
+      break;
 
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
-  }
-  stmts[n] = NULL;
+    case MPC_TYPE_COUNT:
+      mpc_snapshot_write_child(w, p->data.repeat.x);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.repeat.f);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.repeat.dx);
+      mpc_snapshot_write_u32(w, p->data.repeat.n);
+      break;
 
-  return stmts;
-}
+    case MPC_TYPE_OR:
+      mpc_snapshot_write_u32(w, p->data.or.n);
+      for (i = 0; i < p->data.or.n; i++) {
+        mpc_snapshot_write_child(w, p->data.or.xs[i]);
+      }
+      break;
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+    case MPC_TYPE_AND:
+      mpc_snapshot_write_u32(w, p->data.and.n);
+      mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.and.f);
+      for (i = 0; i < p->data.and.n; i++) {
+        mpc_snapshot_write_child(w, p->data.and.xs[i]);
+      }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        mpc_snapshot_write_fn(w, p, (mpc_snapshot_fn_t)p->data.and.dxs[i]);
+      }
+      break;
 
-  mpca_stmt_t **stmts = x;
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      mpc_snapshot_failf(w, "Parser '%s' uses a check that can't be snapshotted!", p->name);
+      break;
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts;
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);
-    stmts++;
+    default: break;
   }
-  free(x);
 
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+static void mpc_snapshot_number(mpc_snapshot_writer_t *w, mpc_parser_t *p) {
 
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+  int i;
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_snapshot_index(w, p->data.expect.x);   break;
+    case MPC_TYPE_APPLY:    mpc_snapshot_index(w, p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: mpc_snapshot_index(w, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_snapshot_index(w, p->data.predict.x);  break;
+    case MPC_TYPE_MATCH:    mpc_snapshot_index(w, p->data.match.x);    break;
+    case MPC_TYPE_SPAN:     mpc_snapshot_index(w, p->data.span.x);     break;
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:      mpc_snapshot_index(w, p->data.not.x);      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_snapshot_index(w, p->data.repeat.x);   break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_snapshot_index(w, p->data.or.xs[i]); }
+      break;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_snapshot_index(w, p->data.and.xs[i]); }
+      break;
+    default: break;
   }
 
-  free(x);
-
-  return NULL;
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+mpc_err_t *mpc_snapshot_save(FILE *f, ...) {
 
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+  int i;
+  mpc_parser_t *p;
+  mpc_snapshot_writer_t w;
+  mpc_err_t *err = NULL;
+  va_list va;
 
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
+  w.f = f;
+  w.check = 2166136261UL;
+  w.roots_num = 0;
+  w.nodes_num = 0;
+  w.nodes_slots = 32;
+  w.nodes = malloc(sizeof(mpc_parser_t*) * w.nodes_slots);
+  w.error = NULL;
 
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
+  va_start(va, f);
+  while ((p = va_arg(va, mpc_parser_t*)) != NULL) {
+    if (!p->retained || p->name == NULL) {
+      mpc_snapshot_failf(&w, "Parser '%s' is not a named parser!", p->name);
+      break;
+    }
+    for (i = 0; i < w.roots_num; i++) {
+      if (w.nodes[i] == p) { break; }
+    }
+    if (i < w.roots_num) { continue; }
+    if (w.nodes_num == w.nodes_slots) {
+      w.nodes_slots = w.nodes_slots * 2;
+      w.nodes = realloc(w.nodes, sizeof(mpc_parser_t*) * w.nodes_slots);
+    }
+    w.nodes[w.nodes_num++] = p;
+    w.roots_num++;
+  }
+  va_end(va);
 
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
+  /* Number every reachable node before anything is written */
+  for (i = 0; i < w.nodes_num && !w.error; i++) {
+    mpc_snapshot_number(&w, w.nodes[i]);
+  }
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+  if (!w.error) {
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+    mpc_snapshot_write_bytes(&w, "MPCS", 4);
+    mpc_snapshot_write_u8(&w, MPC_SNAPSHOT_VERSION);
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+    mpc_snapshot_write_u32(&w, w.roots_num);
+    for (i = 0; i < w.roots_num; i++) {
+      mpc_snapshot_write_str(&w, w.nodes[i]->name);
+    }
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+    mpc_snapshot_write_u32(&w, w.nodes_num);
+    for (i = 0; i < w.nodes_num; i++) {
+      mpc_snapshot_write_node(&w, w.nodes[i]);
+    }
 
-  mpc_optimise(Lang);
-  mpc_optimise(Stmt);
-  mpc_optimise(Grammar);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
+    mpc_snapshot_write_u32(&w, w.check & 0xFFFFFFFFUL);
 
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+    if (!w.error && ferror(f)) {
+      mpc_snapshot_failf(&w, "Unable to write snapshot!", NULL);
+    }
   }
 
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  if (w.error) {
+    err = mpc_err_file("<mpc_snapshot>", w.error);
+    free(w.error);
+  }
 
-  return e;
+  free(w.nodes);
+  return err;
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+/*
+** Loading reads the image twice. The first pass only
+** checks that it is well formed, so that nothing needs
+** to be unpicked if it isn't, and the second builds the
+** parsers, defining the named ones in place.
+**
+** Besides the layout the first pass checks the graph is
+** one `mpc_delete` can take apart: every node which
+** isn't a root has exactly one parent, and following
+** parents from it always ends at a root, so no node is
+** shared, lost or part of a cycle.
+*/
 
-  va_list va;
-  va_start(va, f);
+typedef struct {
+  const unsigned char *data;
+  size_t length;
+  size_t pos;
+  int build;
+  int error;
+  unsigned long roots_num;
+  unsigned long nodes_num;
+  unsigned long node;
+  unsigned long *parents;
+  mpc_parser_t **nodes;
+} mpc_snapshot_reader_t;
+
+static int mpc_snapshot_read_u8(mpc_snapshot_reader_t *r) {
+  if (r->pos + 1 > r->length) { r->error = 1; return 0; }
+  return r->data[r->pos++];
+}
+
+static unsigned long mpc_snapshot_read_u32(mpc_snapshot_reader_t *r) {
+  const unsigned char *b;
+  if (r->pos + 4 > r->length) { r->error = 1; return 0; }
+  b = r->data + r->pos;
+  r->pos += 4;
+  return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16)
+       | ((unsigned long)b[2] <<  8) | ((unsigned long)b[3] <<  0);
+}
+
+static char *mpc_snapshot_read_str(mpc_snapshot_reader_t *r) {
+  char *s;
+  unsigned long l = mpc_snapshot_read_u32(r);
+  if (r->error || l > r->length - r->pos) { r->error = 1; return NULL; }
+  r->pos += l;
+  if (!r->build) { return NULL; }
+  s = malloc(l + 1);
+  memcpy(s, r->data + r->pos - l, l);
+  s[l] = '\0';
+  return s;
+}
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+static mpc_snapshot_fn_t mpc_snapshot_read_fn(mpc_snapshot_reader_t *r, int kind) {
+  int i = mpc_snapshot_read_u8(r);
+  if (i >= MPC_SNAPSHOT_FNS_NUM || mpc_snapshot_fns[i].kind != kind) { r->error = 1; return NULL; }
+  return mpc_snapshot_fns[i].f;
+}
 
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+static mpc_parser_t *mpc_snapshot_read_child(mpc_snapshot_reader_t *r) {
+  unsigned long i = mpc_snapshot_read_u32(r);
+  if (i >= r->nodes_num) { r->error = 1; return NULL; }
+  if (!r->build && i >= r->roots_num) {
+    if (r->parents[i] != r->nodes_num) { r->error = 1; return NULL; }
+    r->parents[i] = r->node;
+  }
+  return r->build ? r->nodes[i] : NULL;
+}
 
-  free(st.parsers);
-  va_end(va);
-  return err;
+static void *mpc_snapshot_read_tag(mpc_snapshot_reader_t *r, unsigned long roots_num) {
+  int kind = mpc_snapshot_read_u8(r);
+  unsigned long i = mpc_snapshot_read_u32(r);
+  if (kind == 0 && i < MPC_SNAPSHOT_TAGS_NUM) { return (void*)mpc_snapshot_tags[i]; }
+  if (kind == 1 && i < roots_num) { return r->build ? r->nodes[i]->name : NULL; }
+  r->error = 1;
+  return NULL;
 }
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+static void mpc_snapshot_read_node(mpc_snapshot_reader_t *r, mpc_parser_t *p, unsigned long roots_num) {
 
-  va_list va;
-  va_start(va, p);
+  int i, type;
+  mpc_pdata_t d;
+  unsigned char set[32], skip[256];
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  memset(&d, 0, sizeof(mpc_pdata_t));
+  type = mpc_snapshot_read_u8(r);
 
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  switch (type) {
 
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_LIFT_VAL:
+      break;
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+    case MPC_TYPE_FAIL: d.fail.m = mpc_snapshot_read_str(r); break;
+    case MPC_TYPE_LIFT: d.lift.lf = (mpc_ctor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_CTOR); break;
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    case MPC_TYPE_EXPECT:
+      d.expect.x = mpc_snapshot_read_child(r);
+      d.expect.m = mpc_snapshot_read_str(r);
+      break;
 
-  va_list va;
-  va_start(va, language);
+    case MPC_TYPE_ANCHOR: d.anchor.f = (int(*)(char,char))mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_ANCHOR); break;
+    case MPC_TYPE_SATISFY: d.satisfy.f = (int(*)(char))mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_SATISFY); break;
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_SINGLE: d.single.x = (char)mpc_snapshot_read_u8(r); break;
+    case MPC_TYPE_RANGE:
+      d.range.x = (char)mpc_snapshot_read_u8(r);
+      d.range.y = (char)mpc_snapshot_read_u8(r);
+      break;
 
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      d.string.x = mpc_snapshot_read_str(r);
+      if (d.string.x && type != MPC_TYPE_STRING) {
+        d.string.set = mpc_class_new(d.string.x, type == MPC_TYPE_NONEOF);
+      }
+      break;
 
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
+    case MPC_TYPE_SET:
+      for (i = 0; i < 32; i++) { set[i] = (unsigned char)mpc_snapshot_read_u8(r); }
+      for (i = 0; i < 256; i++) { skip[i] = (unsigned char)mpc_snapshot_read_u8(r); }
+      d.set.n = (int)mpc_snapshot_read_u32(r);
+      if (r->error || d.set.n < 0 || (size_t)d.set.n > (r->length - r->pos) / 4) { r->error = 1; break; }
+      for (i = 0; i < 256; i++) {
+        if (skip[i] > d.set.n) { r->error = 1; }
+      }
+      if (r->error) { break; }
+      if (r->build) {
+        d.set.x = malloc(32);
+        d.set.skip = malloc(256);
+        memcpy(d.set.x, set, 32);
+        memcpy(d.set.skip, skip, 256);
+      }
+      d.set.ms = r->build && d.set.n ? malloc(sizeof(char*) * d.set.n) : NULL;
+      for (i = 0; i < d.set.n; i++) {
+        char *m = mpc_snapshot_read_str(r);
+        if (d.set.ms) { d.set.ms[i] = m; }
+      }
+      break;
+
+    case MPC_TYPE_APPLY:
+      d.apply.x = mpc_snapshot_read_child(r);
+      d.apply.f = (mpc_apply_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_APPLY);
+      break;
+
+    case MPC_TYPE_APPLY_TO:
+      d.apply_to.x = mpc_snapshot_read_child(r);
+      d.apply_to.f = (mpc_apply_to_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_APPLY_TO);
+      d.apply_to.d = mpc_snapshot_read_tag(r, roots_num);
+      break;
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+    case MPC_TYPE_PREDICT: d.predict.x = mpc_snapshot_read_child(r); break;
+    case MPC_TYPE_SPAN:    d.span.x = mpc_snapshot_read_child(r);    break;
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    case MPC_TYPE_MATCH:
+      d.match.x = mpc_snapshot_read_child(r);
+      d.match.m = NULL;
+      break;
 
-  va_list va;
+    case MPC_TYPE_NOT:
+      d.not.x = mpc_snapshot_read_child(r);
+      d.not.dx = (mpc_dtor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_DTOR);
+      d.not.lf = (mpc_ctor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_CTOR);
+      break;
 
-  FILE *f = fopen(filename, "rb");
+    case MPC_TYPE_MAYBE:
+      d.not.x = mpc_snapshot_read_child(r);
+      d.not.lf = (mpc_ctor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_CTOR);
+      break;
 
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
-  }
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      d.repeat.x = mpc_snapshot_read_child(r);
+      d.repeat.f = (mpc_fold_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_FOLD);
+      break;
 
-  va_start(va, filename);
+    case MPC_TYPE_COUNT:
+      d.repeat.x = mpc_snapshot_read_child(r);
+      d.repeat.f = (mpc_fold_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_FOLD);
+      d.repeat.dx = (mpc_dtor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_DTOR);
+      d.repeat.n = (int)mpc_snapshot_read_u32(r);
+      if (d.repeat.n < 0) { r->error = 1; }
+      break;
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_OR:
+      d.or.n = (int)mpc_snapshot_read_u32(r);
+      if (r->error || d.or.n < 0 || (size_t)d.or.n > (r->length - r->pos) / 4) { r->error = 1; break; }
+      d.or.xs = r->build && d.or.n ? malloc(sizeof(mpc_parser_t*) * d.or.n) : NULL;
+      for (i = 0; i < d.or.n; i++) {
+        mpc_parser_t *x = mpc_snapshot_read_child(r);
+        if (d.or.xs) { d.or.xs[i] = x; }
+      }
+      break;
 
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+    case MPC_TYPE_AND:
+      d.and.n = (int)mpc_snapshot_read_u32(r);
+      d.and.f = (mpc_fold_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_FOLD);
+      if (r->error || d.and.n < 1 || (size_t)d.and.n > (r->length - r->pos) / 4) { r->error = 1; break; }
+      d.and.xs = r->build ? malloc(sizeof(mpc_parser_t*) * d.and.n) : NULL;
+      d.and.dxs = r->build && d.and.n > 1 ? malloc(sizeof(mpc_dtor_t) * (d.and.n-1)) : NULL;
+      for (i = 0; i < d.and.n; i++) {
+        mpc_parser_t *x = mpc_snapshot_read_child(r);
+        if (d.and.xs) { d.and.xs[i] = x; }
+      }
+      for (i = 0; i < d.and.n-1; i++) {
+        mpc_dtor_t dx = (mpc_dtor_t)mpc_snapshot_read_fn(r, MPC_SNAPSHOT_FN_DTOR);
+        if (d.and.dxs) { d.and.dxs[i] = dx; }
+      }
+      break;
 
-  free(st.parsers);
-  va_end(va);
+    default: r->error = 1; break;
+  }
 
-  fclose(f);
+  if (r->build) {
+    p->type = type;
+    p->data = d;
+  }
 
-  return err;
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
-
-  int i, total;
+static mpc_err_t *mpc_snapshot_load_va(const char *filename, const void *data, size_t length, va_list va) {
 
-  if (p->retained && !force) { return 0; }
+  int pass;
+  unsigned long i, j, k, roots_num = 0;
+  int parsers_num = 0;
+  mpc_parser_t *p, **parsers = NULL;
+  mpc_snapshot_reader_t r;
+  mpc_err_t *err = NULL;
+  char *name, *given = NULL;
+  unsigned char *seen = NULL;
 
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+  while ((p = va_arg(va, mpc_parser_t*)) != NULL) {
+    parsers = realloc(parsers, sizeof(mpc_parser_t*) * (parsers_num+1));
+    parsers[parsers_num++] = p;
+  }
 
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  r.data = data;
+  r.length = length;
+  r.parents = NULL;
+  r.nodes = NULL;
 
-  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+  for (pass = 0; pass < 2; pass++) {
 
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+    r.pos = 0;
+    r.build = 0;
+    r.error = 0;
+    r.nodes_num = 0;
 
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+    if (length < 5 || memcmp(data, "MPCS", 4) != 0) {
+      err = mpc_err_file(filename, "Not a parser snapshot!"); break;
+    }
+    r.pos = 4;
 
-  if (p->type == MPC_TYPE_OR) {
-    total = 1;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    if (mpc_snapshot_read_u8(&r) != MPC_SNAPSHOT_VERSION) {
+      err = mpc_err_file(filename, "Unsupported parser snapshot version!"); break;
     }
-    return total;
-  }
 
-  if (p->type == MPC_TYPE_AND) {
-    total = 1;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    /* Everything but the check itself is read from here on */
+    r.length = length;
+    r.pos = length - 4;
+    if (length < 9 || mpc_snapshot_read_u32(&r)
+        != (mpc_fnv1a(data, length - 4, 2166136261UL) & 0xFFFFFFFFUL)) {
+      err = mpc_err_file(filename, "Parser snapshot is corrupt!"); break;
+    }
+    r.length = length - 4;
+    r.pos = 5;
+
+    /* Roots are only counted here, they are matched up by name below */
+    roots_num = mpc_snapshot_read_u32(&r);
+    if (roots_num > length) { r.error = 1; }
+    for (i = 0; i < roots_num && !r.error; i++) {
+      mpc_snapshot_read_str(&r);
     }
-    return total;
-  }
 
-  return 1;
+    r.nodes_num = mpc_snapshot_read_u32(&r);
+    if (r.error || r.nodes_num < roots_num || r.nodes_num > length) {
+      err = mpc_err_file(filename, "Parser snapshot is corrupt!"); break;
+    }
 
-}
+    r.build = pass;
+    r.roots_num = roots_num;
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
-}
+    if (r.build) {
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+      r.pos = 9;
+      r.nodes = calloc(r.nodes_num, sizeof(mpc_parser_t*));
 
-  int i, n, m;
-  mpc_parser_t *t;
+      for (i = 0; i < roots_num; i++) {
+        name = mpc_snapshot_read_str(&r);
+        for (j = 0; j < (unsigned long)parsers_num; j++) {
+          if (parsers[j]->name && strcmp(parsers[j]->name, name) == 0) { break; }
+        }
+        r.nodes[i] = parsers[j];
+        free(name);
+      }
 
-  if (p->retained && !force) { return; }
+      mpc_snapshot_read_u32(&r);
+      for (i = roots_num; i < r.nodes_num; i++) {
+        r.nodes[i] = mpc_undefined();
+      }
 
-  /* Optimise Subexpressions */
+    } else {
 
-  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+      /* Every root must be provided, once, before anything is touched */
+      r.pos = 9;
+      given = calloc(parsers_num + 1, 1);
+      for (i = 0; i < roots_num; i++) {
+        unsigned long l = mpc_snapshot_read_u32(&r);
+        for (j = 0; j < (unsigned long)parsers_num; j++) {
+          if (parsers[j]->name && strlen(parsers[j]->name) == l
+          &&  memcmp(parsers[j]->name, r.data + r.pos, l) == 0) { break; }
+        }
+        if (j == (unsigned long)parsers_num) { break; }
+        if (given[j]) { r.error = 1; break; }
+        given[j] = 1;
+        r.pos += l;
+      }
+      if (i < roots_num && !r.error) {
+        err = mpc_err_file(filename, "Parser snapshot refers to a parser that wasn't given!"); break;
+      }
+      mpc_snapshot_read_u32(&r);
 
-  if (p->type == MPC_TYPE_OR) {
-    for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
-    }
-  }
+      r.parents = malloc(sizeof(unsigned long) * (r.nodes_num + 1));
+      for (i = 0; i < r.nodes_num; i++) { r.parents[i] = r.nodes_num; }
 
-  if (p->type == MPC_TYPE_AND) {
-    for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
     }
-  }
-
-  /* Perform optimisations */
-
-  while (1) {
 
-    /* Merge rhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
-    && !p->data.or.xs[p->data.or.n-1]->retained) {
-      t = p->data.or.xs[p->data.or.n-1];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
+    for (i = 0; i < r.nodes_num && !r.error; i++) {
+      r.node = i;
+      mpc_snapshot_read_node(&r, r.build ? r.nodes[i] : NULL, roots_num);
     }
 
-    /* Merge lhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
-    && !p->data.or.xs[0]->retained) {
-      t = p->data.or.xs[0];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
+    /* Walk up from each node, marking those found to end at a root */
+    if (!r.build && !r.error) {
+      seen = calloc(r.nodes_num + 1, 1);
+      for (i = roots_num; i < r.nodes_num && !r.error; i++) {
+        if (r.parents[i] == r.nodes_num) { r.error = 1; break; }
+        for (k = i; k >= roots_num && seen[k] == 0; k = r.parents[k]) { seen[k] = 1; }
+        if (k >= roots_num && seen[k] == 1) { r.error = 1; }
+        for (k = i; k >= roots_num && seen[k] == 1; k = r.parents[k]) { seen[k] = 2; }
+      }
     }
 
-    /* Remove ast `pass` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
+    if (r.error || r.pos != r.length) {
+      err = mpc_err_file(filename, "Parser snapshot is corrupt!"); break;
     }
+  }
 
-    /* Merge ast lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
-    }
+  /* Dispatch and match tables aren't saved, build them again */
+  for (i = 0; err == NULL && i < r.nodes_num; i++) {
+    p = r.nodes[i];
+    if (p->type == MPC_TYPE_OR) { mpc_optimise_dispatch(p); }
+    if (p->type == MPC_TYPE_MATCH) { p->data.match.m = mpc_match_new(p->data.match.x); }
+  }
 
-    /* Merge ast rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
-    }
+  free(seen);
+  free(given);
+  free(r.parents);
+  free(r.nodes);
+  free(parsers);
+  return err;
+}
 
-    /* Remove re `lift` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
-    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
+mpc_err_t *mpc_snapshot_load(const void *data, size_t length, ...) {
+  mpc_err_t *err;
+  va_list va;
+  va_start(va, length);
+  err = mpc_snapshot_load_va("<mpc_snapshot>", data, length, va);
+  va_end(va);
+  return err;
+}
 
-    /* Merge re lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
-    }
+mpc_err_t *mpc_snapshot_load_contents(const char *filename, ...) {
 
-    /* Merge re rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
-    }
+  mpc_err_t *err;
+  char *data = NULL;
+  size_t length = 0, size = 0, n;
+  va_list va;
 
-    return;
+  FILE *f = fopen(filename, "rb");
 
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
   }
 
-}
+  do {
+    if (length == size) {
+      size = size ? size * 2 : 4096;
+      data = realloc(data, size);
+    }
+    n = fread(data + length, 1, size - length, f);
+    length += n;
+  } while (n > 0);
 
-void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
-}
+  fclose(f);
+
+  va_start(va, filename);
+  err = mpc_snapshot_load_va(filename, data, length, va);
+  va_end(va);
 
+  free(data);
+  return err;
+}
@@ -71,6 +71,105 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parse Modes
+**
+** The `_mode` variants take a combination of
+** these flags. With `MPC_PARSE_STATS` figures
+** about each parse are added up on the parser
+** given and can be seen with `mpc_stats`. They
+** aren't synchronised, so only collect them from
+** one thread at a time.
+**
+** With `MPC_PARSE_AST_ARENA` the parser must
+** produce an `mpc_ast_t` built by the functions
+** below (as `mpca_lang` grammars do). The whole
+** tree is then allocated from a single arena owned
+** by its root, so `mpc_ast_delete` on the root
+** frees it at once and on any other node of it
+** does nothing. Nodes added to it afterwards with
+** `mpc_ast_add_child` are owned by it as usual and
+** freed along with the root.
+**
+** With `MPC_PARSE_PACKRAT` the results of named
+** parsers are remembered by input position, so
+** alternatives which backtrack over the same rule
+** reuse its result rather than parsing it again.
+** The memo is bounded and only used for string,
+** contents and mapped file input. Parsers must be
+** free of side effects for the results to match.
+**
+** With `MPC_PARSE_LAZY_ERRORS` no error is built
+** unless the parse fails, and then it only lists
+** what was expected at the farthest position any
+** expectation failed. This skips the work done on
+** every failed alternative, but the error lacks
+** the wording added by repeats ("one or more of")
+** and can also name an alternative tried early by
+** a dispatch table which the full error leaves out.
+**
+** With `MPC_PARSE_PROFILE` each named parser keeps
+** count of its runs, how many matched or failed,
+** the input rewound while it ran, the bytes it
+** matched and the time spent in it, shown by
+** `mpc_profile` as a table or by `mpc_profile_csv`.
+** Timing every rule slows the parse down, and like
+** the stats these aren't synchronised.
+**
+** With `MPC_PARSE_NO_POS` only the byte offset of
+** the input is kept up to date while parsing. The
+** row and column of an error are worked out from
+** it at the end, but those of `mpc_state_t` values
+** and AST nodes are left at zero. This only applies
+** to string, contents and mapped file input.
+*/
+
+enum {
+  MPC_PARSE_DEFAULT     = 0,
+  MPC_PARSE_STATS       = 1,
+  MPC_PARSE_AST_ARENA   = 2,
+  MPC_PARSE_PACKRAT     = 4,
+  MPC_PARSE_LAZY_ERRORS = 8,
+  MPC_PARSE_PROFILE     = 16,
+  MPC_PARSE_NO_POS      = 32
+};
+
+int mpc_parse_mode(int mode, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse_mode(int mode, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_file_mode(int mode, const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_pipe_mode(int mode, const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_contents_mode(int mode, const char *filename, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Push Parsing
+**
+** A feed parses input which arrives in pieces,
+** such as from a socket, without going back over
+** what it has already seen. Each call to
+** `mpc_parser_feed` hands it the next chunk and
+** returns `MPC_FEED_MORE` while the parse can't
+** be decided yet, otherwise `MPC_FEED_COMPLETE` or
+** `MPC_FEED_ERROR` with `r` filled in as by
+** `mpc_parse`. A chunk of length zero marks the
+** end of the input. Chunks may not hold '\0'.
+** Feeds always run the compiled program of the
+** parser, built for the feed if `mpc_compile`
+** hasn't been called, so packrat mode is ignored.
+*/
+
+typedef struct mpc_feed_t mpc_feed_t;
+
+enum {
+  MPC_FEED_ERROR    = 0,
+  MPC_FEED_COMPLETE = 1,
+  MPC_FEED_MORE     = 2
+};
+
+mpc_feed_t *mpc_feed_new(const char *filename, mpc_parser_t *p);
+mpc_feed_t *mpc_feed_new_mode(int mode, const char *filename, mpc_parser_t *p);
+int mpc_parser_feed(mpc_feed_t *f, const char *chunk, size_t length, mpc_result_t *r);
+void mpc_feed_delete(mpc_feed_t *f);
+
 /*
 ** Function Types
 */
@@ -280,12 +379,15 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -325,6 +427,35 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+/*
+** The traversal above allocates a frame per node. The
+** iterator below walks the same orders using a single
+** growable stack, which can be reused for many trees by
+** calling `mpc_ast_iter_start` again. The visitor stops
+** early when the callback returns 0, in which case it
+** also returns 0.
+*/
+
+typedef struct {
+  mpc_ast_t *node;
+  int child;
+} mpc_ast_iter_frame_t;
+
+typedef struct {
+  mpc_ast_trav_order_t order;
+  int frames_num;
+  int frames_slots;
+  mpc_ast_iter_frame_t *frames;
+} mpc_ast_iter_t;
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it);
+void mpc_ast_iter_start(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order);
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it);
+void mpc_ast_iter_free(mpc_ast_iter_t *it);
+
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order,
+                  int (*f)(mpc_ast_t*, void*), void *data);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -363,6 +494,14 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Snapshots
+*/
+
+mpc_err_t *mpc_snapshot_save(FILE *f, ...);
+mpc_err_t *mpc_snapshot_load(const void *data, size_t length, ...);
+mpc_err_t *mpc_snapshot_load_contents(const char *filename, ...);
+
 /*
 ** Misc
 */
@@ -371,6 +510,23 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
+void mpc_profile(mpc_parser_t *p);
+void mpc_profile_csv(mpc_parser_t *p, FILE *f);
+
+/*
+** `mpc_compile` flattens a finished parser and all
+** the parsers it uses into a program that later
+** parses with it run in a loop rather than through
+** recursive calls. Results and errors are the same
+** either way, except that nesting is no longer
+** capped at `MPC_MAX_RECURSION_DEPTH` levels but by
+** `MPC_PARSE_STACK_BUDGET` bytes of stack, both of
+** which can be defined when building mpc. Compile
+** again after redefining any of its parsers.
+** Packrat parses don't use it.
+*/
+
+void mpc_compile(mpc_parser_t *p);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*),
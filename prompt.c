@@ -1,8 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <editline/readline.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "mpc.h"
 
 static char buffer[2048];
@@ -116,34 +126,39 @@ lval* lval_take(lval* v, int i)
     return x;
 }
 
-void lval_print(lval* v);
+void lval_print_to(lval* v, FILE* f);
 
-void lval_expr_print(lval* v, char open, char close)
+void lval_expr_print_to(lval* v, char open, char close, FILE* f)
 {
-    putchar(open);
+    fputc(open, f);
     for (int i = 0; i < v->count; i++) {
         // print value contained within
-        lval_print(v->cell[i]);
+        lval_print_to(v->cell[i], f);
 
         // dont print trailing space if its the last element
         if (i != (v->count-1)) {
-            putchar(' ');
+            fputc(' ', f);
         }
     }
 
-    putchar(close);
+    fputc(close, f);
 }
 
-void lval_print(lval* v)
+void lval_print_to(lval* v, FILE* f)
 {
     switch (v->type) {
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_ERR: printf("Error: %s", v->err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
+        case LVAL_NUM: fprintf(f, "%li", v->num); break;
+        case LVAL_ERR: fprintf(f, "Error: %s", v->err); break;
+        case LVAL_SYM: fprintf(f, "%s", v->sym); break;
+        case LVAL_SEXPR: lval_expr_print_to(v, '(', ')', f); break;
     }
 }
 
+void lval_print(lval* v)
+{
+    lval_print_to(v, stdout);
+}
+
 void lval_println(lval* v)
 {
     lval_print(v);
@@ -178,6 +193,8 @@ lval* builtin_op(lval* a, char* op)
         if (strcmp(op, "*") == 0) x->num *= y->num;
         if (strcmp(op, "/") == 0) {
             if (y->num == 0) {
+                lval_del(x);
+                lval_del(y);
                 x = lval_err("Division by zero"); break;
             }
             x->num /= y->num;
@@ -232,6 +249,10 @@ lval* lval_eval(lval* v)
     return v;
 }
 
+// lval_read copies everything it needs out of the tree, so trees are
+// built in an arena and released in one go once they have been read
+enum { LREAD_MODE = MPC_PARSE_AST_ARENA };
+
 lval* lval_read_num(mpc_ast_t* t)
 {
     errno = 0;
@@ -249,7 +270,7 @@ lval* lval_read(mpc_ast_t* t)
     // if root (>) or sexpr then create empty list
     lval* x = NULL;
     if (strcmp(t->tag, ">") == 0) x = lval_sexpr();
-    if (strcmp(t->tag, "sexpr")) x = lval_sexpr();
+    if (strstr(t->tag, "sexpr")) x = lval_sexpr();
 
     // fill this list with any valid expression contained within
     for (int i = 0; i < t->children_num; i++) {
@@ -262,15 +283,744 @@ lval* lval_read(mpc_ast_t* t)
     return x;
 }
 
-// repeatedly write message and take in input
-int main(int argc, char *argv[])
+// reads one top level expression at a time from a file into a reusable buffer
+typedef struct
+{
+    FILE* file;
+    char* buf;
+    size_t len;
+    size_t size;
+    mpc_state_t at;
+    mpc_state_t start;
+} lstream;
+
+void lstream_push(lstream* s, char c)
+{
+    // grow geometrically so long expressions stay linear to read
+    if (s->len + 1 >= s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        s->buf = realloc(s->buf, s->size);
+    }
+    s->buf[s->len++] = c;
+    s->buf[s->len] = '\0';
+}
+
+// read a character, keeping track of where in the file it was
+int lstream_getc(lstream* s)
+{
+    int c = getc(s->file);
+    if (c == EOF) return c;
+    s->at.pos++;
+    if (c == '\n') {
+        s->at.row++;
+        s->at.col = 0;
+    } else {
+        s->at.col++;
+    }
+    return c;
+}
+
+int lstream_next(lstream* s)
+{
+    int c;
+    int depth = 0;
+    s->len = 0;
+
+    // skip whitespace between expressions
+    do {
+        s->start = s->at;
+        c = lstream_getc(s);
+    } while (c != EOF && strchr(" \f\n\r\t\v", c));
+
+    if (c == EOF) return 0;
+
+    // a parenthesised expression runs until its matching close
+    if (c == '(') {
+        do {
+            lstream_push(s, c);
+            if (c == '(') depth++;
+            if (c == ')') depth--;
+            if (depth == 0) break;
+        } while ((c = lstream_getc(s)) != EOF);
+        return 1;
+    }
+
+    // a stray close paren is passed on alone so the parser can report it
+    if (c == ')') {
+        lstream_push(s, c);
+        return 1;
+    }
+
+    // otherwise an atom runs until whitespace or a paren
+    do {
+        lstream_push(s, c);
+        c = lstream_getc(s);
+    } while (c != EOF && !strchr(" \f\n\r\t\v()", c));
+
+    // whitespace would only be skipped again, so just a paren goes back
+    if (c == '(' || c == ')') {
+        ungetc(c, s->file);
+        s->at.pos--;
+        s->at.col--;
+    }
+    return 1;
+}
+
+// expressions are parsed on their own, so errors come back relative to the
+// start of the expression and are moved to where it sits in the file
+void lstream_locate(mpc_err_t* e, mpc_state_t start)
+{
+    if (e->state.row == 0) e->state.col += start.col;
+    e->state.row += start.row;
+    e->state.pos += start.pos;
+}
+
+// move a position over the text from p to end
+void lstream_advance(mpc_state_t* s, const char* p, const char* end)
+{
+    const char* nl;
+    s->pos += end - p;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        s->row++;
+        s->col = 0;
+        p = nl + 1;
+    }
+    s->col += end - p;
+}
+
+// binary s-expressions, for inputs that are generated by machine and don't
+// need to go through the parser at all
+//
+//   "LSPB" { <len> <value> }
+//
+//   value: <tag> then per tag
+//     LBIN_NUM      <zigzag number>
+//     LBIN_SYM_DEF  <len> <bytes>, also appending the symbol to the table
+//     LBIN_SYM_REF  <index into the table>
+//     LBIN_SEXPR    <count> <value>...
+//     LBIN_ERR      <len> <bytes>
+//
+// all integers are unsigned little endian base 128 varints, the symbol table
+// starts empty and lasts for the whole stream
+enum { LBIN_NUM, LBIN_SYM_DEF, LBIN_SYM_REF, LBIN_SEXPR, LBIN_ERR };
+
+// frames longer than this are taken to be corrupt, and frames are read a
+// chunk at a time so a bad length can't claim more memory than the file holds
+enum { LBIN_FRAME_MAX = 1 << 30, LBIN_CHUNK = 1 << 16 };
+
+// state for one binary stream, used both to encode and to decode
+typedef struct
+{
+    FILE* file;
+    char** syms;
+    int count;
+    int slots;
+    // the frame being built or read
+    unsigned char* buf;
+    size_t len;
+    size_t size;
+    size_t pos;
+} lbin;
+
+void lbin_init(lbin* b, FILE* file)
+{
+    memset(b, 0, sizeof(lbin));
+    b->file = file;
+}
+
+void lbin_cleanup(lbin* b)
+{
+    for (int i = 0; i < b->count; i++) free(b->syms[i]);
+    free(b->syms);
+    free(b->buf);
+}
+
+void lbin_reserve(lbin* b, size_t n)
+{
+    if (b->len + n > b->size) {
+        // stop doubling before it overflows and take exactly what is needed
+        size_t need = b->len + n;
+        while (need > b->size) {
+            b->size = b->size == 0 ? 256 : b->size > SIZE_MAX / 2 ? need : b->size * 2;
+        }
+        b->buf = realloc(b->buf, b->size);
+    }
+}
+
+void lbin_sym_add(lbin* b, const char* sym, size_t len)
+{
+    if (b->count == b->slots) {
+        b->slots = b->slots ? b->slots * 2 : 16;
+        b->syms = realloc(b->syms, sizeof(char*) * b->slots);
+    }
+    b->syms[b->count] = malloc(len + 1);
+    memcpy(b->syms[b->count], sym, len);
+    b->syms[b->count][len] = '\0';
+    b->count++;
+}
+
+void lbin_put_varint(lbin* b, uint64_t x)
+{
+    lbin_reserve(b, 10);
+    while (x >= 0x80) {
+        b->buf[b->len++] = (x & 0x7F) | 0x80;
+        x >>= 7;
+    }
+    b->buf[b->len++] = x;
+}
+
+void lbin_put_str(lbin* b, const char* s)
+{
+    size_t len = strlen(s);
+    lbin_put_varint(b, len);
+    lbin_reserve(b, len);
+    memcpy(b->buf + b->len, s, len);
+    b->len += len;
+}
+
+void lbin_encode(lbin* b, lval* v)
+{
+    switch (v->type) {
+        case LVAL_NUM:
+            lbin_put_varint(b, LBIN_NUM);
+            // zigzag so small negative numbers stay short too
+            lbin_put_varint(b, ((uint64_t)v->num << 1) ^ (uint64_t)(v->num < 0 ? -1 : 0));
+        break;
+        case LVAL_ERR:
+            lbin_put_varint(b, LBIN_ERR);
+            lbin_put_str(b, v->err);
+        break;
+        case LVAL_SYM: {
+            int i;
+            for (i = 0; i < b->count; i++) {
+                if (strcmp(b->syms[i], v->sym) == 0) break;
+            }
+            if (i < b->count) {
+                lbin_put_varint(b, LBIN_SYM_REF);
+                lbin_put_varint(b, i);
+            } else {
+                lbin_put_varint(b, LBIN_SYM_DEF);
+                lbin_put_str(b, v->sym);
+                lbin_sym_add(b, v->sym, strlen(v->sym));
+            }
+        }
+        break;
+        case LVAL_SEXPR:
+            lbin_put_varint(b, LBIN_SEXPR);
+            lbin_put_varint(b, v->count);
+            for (int i = 0; i < v->count; i++) {
+                lbin_encode(b, v->cell[i]);
+            }
+        break;
+    }
+}
+
+// write one value as a frame of its own
+void lbin_put(lbin* b, lval* v)
+{
+    b->len = 0;
+    lbin_encode(b, v);
+
+    unsigned char head[10];
+    int n = 0;
+    uint64_t x = b->len;
+    while (x >= 0x80) {
+        head[n++] = (x & 0x7F) | 0x80;
+        x >>= 7;
+    }
+    head[n++] = x;
+
+    fwrite(head, 1, n, b->file);
+    fwrite(b->buf, 1, b->len, b->file);
+}
+
+// a varint straight from the file, 0 at the end of the stream or if cut short
+int lbin_get_varint_file(FILE* f, uint64_t* x)
+{
+    int c;
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if ((c = fgetc(f)) == EOF) return 0;
+        *x |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    return 0;
+}
+
+int lbin_get_varint(lbin* b, uint64_t* x)
+{
+    *x = 0;
+    for (int shift = 0; shift < 64 && b->pos < b->len; shift += 7) {
+        unsigned char c = b->buf[b->pos++];
+        *x |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// a length prefixed string from the frame, pointing into the frame itself
+const char* lbin_get_bytes(lbin* b, size_t* len)
+{
+    uint64_t n;
+    if (!lbin_get_varint(b, &n) || n > b->len - b->pos) return NULL;
+    const char* s = (const char*)b->buf + b->pos;
+    b->pos += n;
+    *len = n;
+    return s;
+}
+
+lval* lbin_decode(lbin* b)
+{
+    uint64_t tag, x;
+    const char* s;
+    size_t len;
+    lval* v;
+
+    if (!lbin_get_varint(b, &tag)) return NULL;
+
+    switch (tag) {
+        case LBIN_NUM:
+            if (!lbin_get_varint(b, &x)) return NULL;
+            return lval_num((long)((x >> 1) ^ -(x & 1)));
+        case LBIN_SYM_DEF:
+        case LBIN_ERR:
+            if ((s = lbin_get_bytes(b, &len)) == NULL) return NULL;
+            lbin_sym_add(b, s, len);
+            v = tag == LBIN_ERR ? lval_err(b->syms[b->count-1]) : lval_sym(b->syms[b->count-1]);
+            // errors only borrow the table entry to get a terminated string
+            if (tag == LBIN_ERR) free(b->syms[--b->count]);
+            return v;
+        case LBIN_SYM_REF:
+            if (!lbin_get_varint(b, &x) || x >= (uint64_t)b->count) return NULL;
+            return lval_sym(b->syms[x]);
+        case LBIN_SEXPR:
+            // every cell takes at least two bytes, which bounds bad counts
+            if (!lbin_get_varint(b, &x) || x > (b->len - b->pos) / 2) return NULL;
+            v = lval_sexpr();
+            for (uint64_t i = 0; i < x; i++) {
+                lval* c = lbin_decode(b);
+                if (c == NULL) {
+                    lval_del(v);
+                    return NULL;
+                }
+                lval_add(v, c);
+            }
+            return v;
+    }
+    return NULL;
+}
+
+// read the next frame, NULL at the end of the stream with corrupt cleared,
+// or NULL with corrupt set if the stream is malformed
+lval* lbin_get(lbin* b, int* corrupt)
+{
+    uint64_t len;
+    *corrupt = 0;
+
+    int c = fgetc(b->file);
+    if (c == EOF) return NULL;
+    ungetc(c, b->file);
+
+    if (!lbin_get_varint_file(b->file, &len) || len > LBIN_FRAME_MAX) {
+        *corrupt = 1;
+        return NULL;
+    }
+
+    b->len = 0;
+    b->pos = 0;
+    while (b->len < len) {
+        size_t n = len - b->len < LBIN_CHUNK ? len - b->len : LBIN_CHUNK;
+        lbin_reserve(b, n);
+        if (fread(b->buf + b->len, 1, n, b->file) != n) {
+            *corrupt = 1;
+            return NULL;
+        }
+        b->len += n;
+    }
+
+    lval* v = lbin_decode(b);
+    if (v == NULL || b->pos != b->len) {
+        if (v) lval_del(v);
+        *corrupt = 1;
+        return NULL;
+    }
+    return v;
+}
+
+// evaluate a binary stream whose magic has already been read
+void lval_eval_binary(const char* filename, FILE* file)
+{
+    lbin b;
+    lbin_init(&b, file);
+
+    lval* x;
+    int corrupt;
+    while ((x = lbin_get(&b, &corrupt)) != NULL) {
+        x = lval_eval(x);
+        lval_println(x);
+        lval_del(x);
+    }
+    if (corrupt) {
+        fprintf(stderr, "%s: error: corrupt binary expression\n", filename);
+    }
+
+    lbin_cleanup(&b);
+}
+
+// evaluate and print each top level expression of a file in turn, only ever
+// holding one expression in memory so arbitrarily large inputs stay flat
+void lcache_put_err(lbin* cache, const char* msg);
+
+typedef struct lloader lloader;
+void lval_eval_parallel(const char* filename, FILE* file, lloader* loader, lbin* cache);
+
+void lval_eval_stream(const char* filename, FILE* file, mpc_parser_t* lispy, lbin* cache, lloader* loader)
+{
+    lstream s = { file, NULL, 0, 0, { 0 }, { 0 } };
+
+    // text can't start with an 'L' so that is enough to spot a binary stream
+    int c = getc(file);
+    if (c == 'L') {
+        char magic[3];
+        if (fread(magic, 1, 3, file) == 3 && memcmp(magic, "SPB", 3) == 0) {
+            lval_eval_binary(filename, file);
+        } else {
+            fprintf(stderr, "%s: error: bad binary header\n", filename);
+        }
+        return;
+    }
+    if (c != EOF) ungetc(c, file);
+
+    // with a loader whole blocks of expressions are parsed on several threads
+    if (loader) {
+        lval_eval_parallel(filename, file, loader, cache);
+        return;
+    }
+
+    while (lstream_next(&s)) {
+        // lval_read never looks at positions, so they are only worked out for errors
+        mpc_result_t r;
+        if (mpc_nparse_mode(LREAD_MODE | MPC_PARSE_NO_POS, filename, s.buf, s.len, lispy, &r)) {
+            lval* x = lval_read(r.output);
+            if (cache) {
+                fputc('X', cache->file);
+                lbin_put(cache, x);
+            }
+            x = lval_eval(x);
+            lval_println(x);
+            lval_del(x);
+            mpc_ast_delete(r.output);
+        } else {
+            lstream_locate(r.error, s.start);
+            char* msg = mpc_err_string(r.error);
+            if (cache) lcache_put_err(cache, msg);
+            fputs(msg, stdout);
+            free(msg);
+            mpc_err_delete(r.error);
+        }
+    }
+
+    free(s.buf);
+}
+
+// convert a text script into a binary one, reporting any parse errors
+int lval_encode(const char* in, const char* out, mpc_parser_t* lispy)
+{
+    FILE* fin = fopen(in, "rb");
+    if (fin == NULL) {
+        fprintf(stderr, "Unable to open file '%s'\n", in);
+        return 1;
+    }
+    FILE* fout = fopen(out, "wb");
+    if (fout == NULL) {
+        fprintf(stderr, "Unable to open file '%s'\n", out);
+        fclose(fin);
+        return 1;
+    }
+
+    lbin b;
+    lbin_init(&b, fout);
+    fwrite("LSPB", 1, 4, fout);
+
+    lstream s = { fin, NULL, 0, 0, { 0 }, { 0 } };
+    int status = 0;
+    while (lstream_next(&s)) {
+        mpc_result_t r;
+        if (mpc_nparse_mode(LREAD_MODE | MPC_PARSE_NO_POS, in, s.buf, s.len, lispy, &r)) {
+            lval* x = lval_read(r.output);
+            lbin_put(&b, x);
+            lval_del(x);
+            mpc_ast_delete(r.output);
+        } else {
+            lstream_locate(r.error, s.start);
+            mpc_err_print_to(r.error, stderr);
+            mpc_err_delete(r.error);
+            status = 1;
+        }
+    }
+
+    if (ferror(fin) || ferror(fout)) status = 1;
+    free(s.buf);
+    lbin_cleanup(&b);
+    fclose(fin);
+    if (fclose(fout) != 0) status = 1;
+    return status;
+}
+
+// a script's cache holds the read form of each of its expressions, in order,
+// so re-running an unchanged script skips parsing altogether
+//
+//   "LSPC" <version> <fnv-1a hash of the source:8>
+//   { 'X' <binary frame> | 'E' <len:4> <parse error> }
+//
+// the frames share one symbol table as in a binary stream
+enum { LCACHE_VERSION = 2 };
+
+uint64_t lcache_hash(FILE* f)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void lcache_put_u32(FILE* f, uint32_t x)
+{
+    for (int i = 24; i >= 0; i -= 8) fputc((x >> i) & 0xFF, f);
+}
+
+void lcache_put_u64(FILE* f, uint64_t x)
+{
+    for (int i = 56; i >= 0; i -= 8) fputc((x >> i) & 0xFF, f);
+}
+
+void lcache_put_err(lbin* cache, const char* msg)
+{
+    size_t len = strlen(msg);
+    fputc('E', cache->file);
+    lcache_put_u32(cache->file, len);
+    fwrite(msg, 1, len, cache->file);
+}
+
+int lcache_get_u32(FILE* f, uint32_t* x)
+{
+    unsigned char b[4];
+    if (fread(b, 1, 4, f) != 4) return 0;
+    *x = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    return 1;
+}
+
+int lcache_get_u64(FILE* f, uint64_t* x)
+{
+    uint32_t hi, lo;
+    if (!lcache_get_u32(f, &hi) || !lcache_get_u32(f, &lo)) return 0;
+    *x = ((uint64_t)hi << 32) | lo;
+    return 1;
+}
+
+char* lcache_get_str(FILE* f)
+{
+    uint32_t len;
+    if (!lcache_get_u32(f, &len)) return NULL;
+
+    // grow as the bytes arrive so a bad length can't claim more than the file holds
+    char* s = NULL;
+    size_t got = 0, size = 0;
+    while (got < len) {
+        size_t n = len - got < 4096 ? len - got : 4096;
+        if (got + n + 1 > size) {
+            size = size ? size * 2 : 256;
+            if (size < got + n + 1) size = got + n + 1;
+            s = realloc(s, size);
+        }
+        if (fread(s + got, 1, n, f) != n) {
+            free(s);
+            return NULL;
+        }
+        got += n;
+    }
+    if (s == NULL) s = malloc(1);
+    s[len] = '\0';
+    return s;
+}
+
+// the cache sits next to the script, foo.lspy -> foo.lspc
+char* lcache_path(const char* filename)
+{
+    size_t len = strlen(filename);
+    char* path = malloc(len + 6);
+    strcpy(path, filename);
+    if (len > 5 && strcmp(path + len - 5, ".lspy") == 0) {
+        strcpy(path + len - 5, ".lspc");
+    } else {
+        strcat(path, ".lspc");
+    }
+    return path;
+}
+
+// open the cache for reading if it was built from this exact source
+FILE* lcache_open(const char* path, uint64_t hash)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+
+    char magic[5];
+    uint64_t h;
+    if (fread(magic, 1, 5, f) != 5
+    ||  memcmp(magic, "LSPC", 4) != 0 || magic[4] != LCACHE_VERSION
+    ||  !lcache_get_u64(f, &h) || h != hash) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+// go through every expression in the cache, evaluating them only if run is
+// set, 0 if it turned out to be corrupt
+int lcache_eval(FILE* f, int run)
+{
+    lbin b;
+    lbin_init(&b, f);
+
+    int c, corrupt = 0;
+    while (!corrupt && (c = fgetc(f)) != EOF) {
+        if (c == 'X') {
+            lval* x = lbin_get(&b, &corrupt);
+            if (x == NULL) {
+                corrupt = 1;
+                break;
+            }
+            if (run) {
+                x = lval_eval(x);
+                lval_println(x);
+            }
+            lval_del(x);
+        } else if (c == 'E') {
+            char* msg = lcache_get_str(f);
+            if (msg == NULL) {
+                corrupt = 1;
+                break;
+            }
+            if (run) fputs(msg, stdout);
+            free(msg);
+        } else {
+            corrupt = 1;
+        }
+    }
+
+    lbin_cleanup(&b);
+    return !corrupt;
+}
+
+// evaluate a script, going through its cache when it is up to date and
+// rebuilding the cache from the source when it is missing or stale
+void lval_eval_file(const char* filename, FILE* file, mpc_parser_t* lispy, int use_cache, lloader* loader)
+{
+    // hashing reads the source through once, which only a regular file can repeat
+    struct stat st;
+    int regular = fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+
+    // binary scripts are already cheap to load so aren't worth caching, the
+    // magic is only peeked at where it can be read again
+    char magic[4];
+    int binary = 0;
+    if (use_cache && regular) {
+        binary = fread(magic, 1, 4, file) == 4 && memcmp(magic, "LSPB", 4) == 0;
+        if (fseek(file, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "Unable to read file '%s'\n", filename);
+            return;
+        }
+    }
+
+    if (!use_cache || binary || !regular) {
+        lval_eval_stream(filename, file, lispy, NULL, loader);
+        return;
+    }
+
+    uint64_t hash = lcache_hash(file);
+    if (ferror(file) || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Unable to read file '%s'\n", filename);
+        return;
+    }
+
+    // the whole cache is checked before anything runs, so a bad one can be
+    // dropped in favour of the source without repeating any output
+    char* path = lcache_path(filename);
+    FILE* cached = lcache_open(path, hash);
+    if (cached) {
+        long start = ftell(cached);
+        int ok = lcache_eval(cached, 0);
+        if (ok && fseek(cached, start, SEEK_SET) == 0) {
+            lcache_eval(cached, 1);
+            fclose(cached);
+            free(path);
+            return;
+        }
+        fclose(cached);
+        fprintf(stderr, "Cache '%s' is corrupt, rebuilding it\n", path);
+        remove(path);
+    }
+
+    // write to a temporary name so a half written cache is never picked up
+    char* tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    FILE* cache = fopen(tmp, "wb");
+    lbin b;
+    if (cache) {
+        fwrite("LSPC", 1, 4, cache);
+        fputc(LCACHE_VERSION, cache);
+        lcache_put_u64(cache, hash);
+        lbin_init(&b, cache);
+    }
+
+    lval_eval_stream(filename, file, lispy, cache ? &b : NULL, loader);
+
+    if (cache) {
+        lbin_cleanup(&b);
+        int failed = ferror(cache) || ferror(file);
+        if (fclose(cache) == 0 && !failed) {
+            rename(tmp, path);
+        } else {
+            remove(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+}
+
+// the parsers making up the lispy grammar, one set per interpreter
+typedef struct
+{
+    mpc_parser_t* number;
+    mpc_parser_t* symbol;
+    mpc_parser_t* sexpr;
+    mpc_parser_t* expr;
+    mpc_parser_t* lispy;
+} lgrammar;
+
+void lgrammar_init(lgrammar* g, const char* snapshot)
 {
     // create some parsers
-    mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Symbol = mpc_new("symbol");
-    mpc_parser_t* Sexpr = mpc_new("sexpr");
-    mpc_parser_t* Expr = mpc_new("expr");
-    mpc_parser_t* Lispy = mpc_new("lispy");
+    g->number = mpc_new("number");
+    g->symbol = mpc_new("symbol");
+    g->sexpr = mpc_new("sexpr");
+    g->expr = mpc_new("expr");
+    g->lispy = mpc_new("lispy");
+
+    // a saved snapshot skips compiling the grammar, fall back to it if unusable
+    if (snapshot) {
+        mpc_err_t* err = mpc_snapshot_load_contents(snapshot,
+                g->number, g->symbol, g->sexpr, g->expr, g->lispy, NULL);
+        if (err == NULL) {
+            mpc_compile(g->lispy);
+            return;
+        }
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+    }
 
     // define them with the following lang
     mpca_lang(MPCA_LANG_DEFAULT,
@@ -279,9 +1029,464 @@ int main(int argc, char *argv[])
             symbol : '+' | '-' | '*' | '/' ; \
             sexpr : '(' <expr>* ')' ; \
             expr : <number> | <symbol> | <sexpr> ; \
-            lispy : /^/ <operator> <expr>+ /$/ ; \
+            lispy : /^/ <expr>* /$/ ; \
             ",
-            Number, Symbol, Sexpr, Expr, Lispy);
+            g->number, g->symbol, g->sexpr, g->expr, g->lispy, NULL);
+
+    // every parse starts from lispy, so run it as a flat program
+    mpc_compile(g->lispy);
+}
+
+void lgrammar_cleanup(lgrammar* g)
+{
+    mpc_cleanup(5, g->number, g->symbol, g->sexpr, g->expr, g->lispy);
+}
+
+// write the compiled grammar out so later runs can load it with --grammar
+int lgrammar_save(lgrammar* g, const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return 1;
+    }
+
+    mpc_err_t* err = mpc_snapshot_save(f,
+            g->number, g->symbol, g->sexpr, g->expr, g->lispy, NULL);
+    fclose(f);
+
+    if (err) {
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+        return 1;
+    }
+    return 0;
+}
+
+// the parallel loader reads a file a block at a time, cuts each block into
+// top level expressions the same way lstream_next would, and has every job
+// parse and read a run of them with its own grammar, so nothing is shared
+// while parsing. the read forms are then evaluated and printed in order
+enum { LLOAD_BLOCK = 1 << 20 };
+
+struct lloader
+{
+    int jobs;
+    lgrammar* grammars;
+    pthread_t* threads;
+};
+
+// one top level expression of the block, with its read form or parse error
+typedef struct
+{
+    const char* start;
+    size_t len;
+    lval* x;
+    mpc_err_t* err;
+} lexpr;
+
+// the run of expressions a single job parses
+typedef struct
+{
+    const char* filename;
+    lgrammar* g;
+    lexpr* exprs;
+    int count;
+} ljob;
+
+lloader* lloader_new(int jobs, const char* grammar)
+{
+    lloader* l = malloc(sizeof(lloader));
+    l->jobs = jobs;
+    l->grammars = malloc(sizeof(lgrammar) * jobs);
+    l->threads = malloc(sizeof(pthread_t) * jobs);
+    for (int i = 0; i < jobs; i++) lgrammar_init(&l->grammars[i], grammar);
+    return l;
+}
+
+void lloader_delete(lloader* l)
+{
+    for (int i = 0; i < l->jobs; i++) lgrammar_cleanup(&l->grammars[i]);
+    free(l->grammars);
+    free(l->threads);
+    free(l);
+}
+
+// cut the next expression out of buf from *pos, 0 once only whitespace is
+// left, or -1 if it might carry on into the part of the file not yet read
+int lsplit_next(const char* buf, size_t len, int eof, size_t* pos, lexpr* e)
+{
+    size_t i = *pos;
+
+    while (i < len && strchr(" \f\n\r\t\v", (unsigned char)buf[i])) i++;
+    *pos = i;
+    if (i == len) return 0;
+
+    e->start = buf + i;
+    if (buf[i] == '(') {
+        // only the parens matter, counted in one pass so closing runs aren't rescanned
+        int depth = 0;
+        while (i < len) {
+            char c = buf[i++];
+            if (c == '(') depth++;
+            else if (c == ')' && --depth == 0) break;
+        }
+        if (depth != 0 && !eof) return -1;
+    } else if (buf[i] == ')') {
+        i++;
+    } else {
+        while (i < len && !strchr(" \f\n\r\t\v()", (unsigned char)buf[i])) i++;
+        if (i == len && !eof) return -1;
+    }
+
+    e->len = buf + i - e->start;
+    *pos = i;
+    return 1;
+}
+
+void* ljob_run(void* arg)
+{
+    ljob* j = arg;
+    for (int i = 0; i < j->count; i++) {
+        lexpr* e = &j->exprs[i];
+        mpc_result_t r;
+        if (mpc_nparse_mode(LREAD_MODE | MPC_PARSE_NO_POS, j->filename, e->start, e->len, j->g->lispy, &r)) {
+            e->x = lval_read(r.output);
+            e->err = NULL;
+            mpc_ast_delete(r.output);
+        } else {
+            e->x = NULL;
+            e->err = r.error;
+        }
+    }
+    return NULL;
+}
+
+void lval_eval_parallel(const char* filename, FILE* file, lloader* loader, lbin* cache)
+{
+    size_t size = LLOAD_BLOCK, len = 0;
+    char* buf = malloc(size);
+    int count = 0, slots = 0, eof = 0;
+    lexpr* exprs = NULL;
+    ljob* jobs = malloc(sizeof(ljob) * loader->jobs);
+    mpc_state_t at = { 0 };
+
+    while (!eof) {
+        len += fread(buf + len, 1, size - len, file);
+        eof = len < size;
+
+        size_t pos = 0;
+        lexpr e;
+        count = 0;
+        while (lsplit_next(buf, len, eof, &pos, &e) == 1) {
+            if (count == slots) {
+                slots = slots ? slots * 2 : 1024;
+                exprs = realloc(exprs, sizeof(lexpr) * slots);
+            }
+            exprs[count++] = e;
+        }
+
+        // hand each job a run of expressions covering about the same number of bytes
+        int n = 0, k = 0;
+        for (int i = 0; i < loader->jobs && k < count; i++) {
+            const char* limit = buf + pos * (i + 1) / loader->jobs;
+            int first = k;
+            while (k < count && (exprs[k].start < limit || i == loader->jobs - 1)) k++;
+            if (k == first) continue;
+            jobs[n].filename = filename;
+            jobs[n].g = &loader->grammars[n];
+            jobs[n].exprs = exprs + first;
+            jobs[n].count = k - first;
+            pthread_create(&loader->threads[n], NULL, ljob_run, &jobs[n]);
+            n++;
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(loader->threads[i], NULL);
+        }
+
+        // errors are moved to file positions as they come, counting the
+        // lines between them, and then over the rest of the block
+        const char* seen = buf;
+        for (int i = 0; i < count; i++) {
+            if (exprs[i].x) {
+                lval* x = exprs[i].x;
+                if (cache) {
+                    fputc('X', cache->file);
+                    lbin_put(cache, x);
+                }
+                x = lval_eval(x);
+                lval_println(x);
+                lval_del(x);
+            } else {
+                lstream_advance(&at, seen, exprs[i].start);
+                seen = exprs[i].start;
+                lstream_locate(exprs[i].err, at);
+                char* msg = mpc_err_string(exprs[i].err);
+                if (cache) lcache_put_err(cache, msg);
+                fputs(msg, stdout);
+                free(msg);
+                mpc_err_delete(exprs[i].err);
+            }
+        }
+
+        // carry the unfinished expression over, making room if it fills the block
+        lstream_advance(&at, seen, buf + pos);
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+        if (len == size) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+
+    free(jobs);
+    free(exprs);
+    free(buf);
+}
+
+// shared between the workers of the eval server
+typedef struct
+{
+    int fd;
+    int id;
+    const char* grammar;
+} lworker;
+
+long elapsed_us(struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000L
+        + (end.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+// read one request, either a plain line or ":<length>" followed by exactly
+// that many bytes, so expressions containing newlines can be sent as well
+char* lworker_read(FILE* in, char** line, size_t* size)
+{
+    ssize_t n;
+
+    while ((n = getline(line, size, in)) != -1) {
+        while (n > 0 && ((*line)[n-1] == '\n' || (*line)[n-1] == '\r')) {
+            (*line)[--n] = '\0';
+        }
+
+        if ((*line)[0] != ':') {
+            if (n == 0) continue;
+            return *line;
+        }
+
+        char* end;
+        long len = strtol(*line + 1, &end, 10);
+        if (*end != '\0' || len < 0) return NULL;
+
+        if ((size_t)len + 1 > *size) {
+            *size = len + 1;
+            *line = realloc(*line, *size);
+        }
+        if (fread(*line, 1, len, in) != (size_t)len) return NULL;
+        (*line)[len] = '\0';
+        return *line;
+    }
+
+    return NULL;
+}
+
+void* lworker_run(void* arg)
+{
+    lworker* w = arg;
+    char* line = NULL;
+    size_t size = 0;
+    long served = 0, total_us = 0, max_us = 0;
+
+    // each worker gets its own interpreter so nothing is shared while parsing
+    lgrammar g;
+    lgrammar_init(&g, w->grammar);
+
+    while (1) {
+        int conn = accept(w->fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        // without streams for both directions the client is dropped
+        FILE* in = fdopen(conn, "r");
+        int fd = in ? dup(conn) : -1;
+        FILE* out = fd != -1 ? fdopen(fd, "w") : NULL;
+        if (out == NULL) {
+            perror("fdopen");
+            if (fd != -1) close(fd);
+            if (in) fclose(in); else close(conn);
+            continue;
+        }
+        char* expr;
+
+        while ((expr = lworker_read(in, &line, &size)) != NULL) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            mpc_result_t r;
+            if (mpc_parse_mode(LREAD_MODE, "<socket>", expr, g.lispy, &r)) {
+                lval* x = lval_eval(lval_read(r.output));
+                lval_print_to(x, out);
+                fputc('\n', out);
+                lval_del(x);
+                mpc_ast_delete(r.output);
+            } else {
+                mpc_err_print_to(r.error, out);
+                mpc_err_delete(r.error);
+            }
+            fflush(out);
+
+            long us = elapsed_us(&start);
+            served++;
+            total_us += us;
+            if (us > max_us) max_us = us;
+            fprintf(stderr, "worker %d: %ld us (served %ld, avg %ld us, max %ld us)\n",
+                    w->id, us, served, total_us / served, max_us);
+        }
+
+        fclose(in);
+        fclose(out);
+    }
+
+    free(line);
+    lgrammar_cleanup(&g);
+    return NULL;
+}
+
+// listen on a unix domain socket and evaluate requests on a fixed pool of workers
+int lval_serve(const char* path, int workers, const char* grammar)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) { perror("socket"); return 1; }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+    ||  listen(fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+
+    // a client hanging up early should not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+    lworker* ws = malloc(sizeof(lworker) * workers);
+    for (int i = 0; i < workers; i++) {
+        ws[i].fd = fd;
+        ws[i].id = i;
+        ws[i].grammar = grammar;
+        pthread_create(&threads[i], NULL, lworker_run, &ws[i]);
+    }
+
+    fprintf(stderr, "Serving on %s with %d workers\n", path, workers);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(ws);
+    close(fd);
+    unlink(path);
+    return 0;
+}
+
+// repeatedly write message and take in input
+int main(int argc, char *argv[])
+{
+    char* serve = NULL;
+    char* grammar = NULL;
+    char* save_grammar = NULL;
+    char* encode_in = NULL;
+    char* encode_out = NULL;
+    int workers = 4;
+    int jobs = 1;
+    int use_cache = 1;
+    int files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve = argv[++i];
+        } else if (strcmp(argv[i], "--grammar") == 0 && i + 1 < argc) {
+            grammar = argv[++i];
+        } else if (strcmp(argv[i], "--save-grammar") == 0 && i + 1 < argc) {
+            save_grammar = argv[++i];
+        } else if (strcmp(argv[i], "--encode") == 0 && i + 2 < argc) {
+            encode_in = argv[++i];
+            encode_out = argv[++i];
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers < 1) workers = 1;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) jobs = 1;
+        } else {
+            // gather the remaining arguments at the front as files to run
+            argv[files++] = argv[i];
+        }
+    }
+
+    lgrammar g;
+    lgrammar_init(&g, grammar);
+    mpc_parser_t* Lispy = g.lispy;
+
+    if (save_grammar) {
+        int status = lgrammar_save(&g, save_grammar);
+        lgrammar_cleanup(&g);
+        return status;
+    }
+
+    if (encode_in) {
+        int status = lval_encode(encode_in, encode_out, Lispy);
+        lgrammar_cleanup(&g);
+        return status;
+    }
+
+    if (serve) {
+        int status = lval_serve(serve, workers, grammar);
+        lgrammar_cleanup(&g);
+        return status;
+    }
+
+    // with file arguments evaluate them as streams instead of starting the repl
+    if (files > 0) {
+        lloader* loader = jobs > 1 ? lloader_new(jobs, grammar) : NULL;
+        for (int i = 0; i < files; i++) {
+            if (strcmp(argv[i], "-") == 0) {
+                lval_eval_stream("<stdin>", stdin, Lispy, NULL, loader);
+                continue;
+            }
+
+            FILE* f = fopen(argv[i], "rb");
+            if (f == NULL) {
+                fprintf(stderr, "Unable to open file '%s'\n", argv[i]);
+                continue;
+            }
+
+            lval_eval_file(argv[i], f, Lispy, use_cache, loader);
+            fclose(f);
+        }
+
+        if (loader) lloader_delete(loader);
+        lgrammar_cleanup(&g);
+        return 0;
+    }
 
     // print version and exit information
     puts("Lispy Version 0.0.0.0.1");
@@ -297,7 +1502,7 @@ int main(int argc, char *argv[])
 
         // attempt to parse input
         mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
+        if (mpc_parse_mode(LREAD_MODE, "<stdin>", input, Lispy, &r)) {
             // on success print the abstract syntax tree
             // mpc_ast_print(r.output);
             // mpc_ast_delete(r.output);
@@ -322,7 +1527,7 @@ int main(int argc, char *argv[])
     }
 
     // clean up code
-    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
+    lgrammar_cleanup(&g);
 
     return 0;
 }